@@ -0,0 +1,62 @@
+// Per-parse monotonic arena shared by gif_parser and mp4_parser.
+//
+// Parse trees allocate many small nodes that all die together. Carving
+// them out of an Arena costs a pointer bump each, and the first few KiB
+// come from a buffer inside the arena itself, so a small file's tree
+// makes no heap allocation at all. Larger trees take blocks that grow
+// geometrically, which is a handful of heap allocations per file. Nothing
+// is freed one node at a time: release() or the destructor gives back
+// everything at once.
+//
+// Containers take it as a std::pmr::memory_resource, e.g.
+// std::pmr::vector<T> nodes(&arena).
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+struct Arena : std::pmr::memory_resource {
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // heap allocations made for blocks since construction
+    size_t heapBlocks() const { return heap.blocks; }
+
+    // frees every node and every block but the inline buffer
+    void release() { pool.release(); }
+
+    template <typename T, typename... Args> T *make(Args &&...args) {
+        return new (allocate(sizeof(T), alignof(T)))
+            T(std::forward<Args>(args)...);
+    }
+
+  private:
+    struct Heap : std::pmr::memory_resource {
+        size_t blocks = 0;
+        void *do_allocate(size_t bytes, size_t alignment) override {
+            ++blocks;
+            return std::pmr::new_delete_resource()->allocate(bytes,
+                                                             alignment);
+        }
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const memory_resource &other) const
+            noexcept override {
+            return this == &other;
+        }
+    } heap;
+    alignas(std::max_align_t) std::byte initial[4096];
+    std::pmr::monotonic_buffer_resource pool{initial, sizeof(initial), &heap};
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        return pool.allocate(bytes, alignment);
+    }
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
@@ -0,0 +1,124 @@
+// Batch support shared by gif_parser --batch and mp4_parser --batch: which
+// files a batch covers, and a pool that scans them on several threads.
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs `tasks` independent tasks on `threads` workers. Each worker starts
+// with a contiguous block of task indices in its own deque and takes from
+// the back; an idle worker steals half of another worker's deque from the
+// front. Files in one directory tend to stay on one worker, and a worker
+// stuck on a few huge files gives the rest of its block away.
+struct WorkStealingPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    static void
+    run(size_t tasks, size_t threads,
+        const std::function<void(size_t worker, size_t task)> &work) {
+        threads = std::max<size_t>(1, std::min(threads, tasks));
+        std::vector<Queue> queues(threads);
+        for (size_t w = 0; w < threads; ++w) {
+            for (size_t t = tasks * w / threads; t < tasks * (w + 1) / threads;
+                 ++t) {
+                queues[w].tasks.push_back(t);
+            }
+        }
+
+        auto next = [&queues, threads](size_t w, size_t &task) {
+            {
+                std::lock_guard<std::mutex> lock(queues[w].mutex);
+                if (!queues[w].tasks.empty()) {
+                    task = queues[w].tasks.back();
+                    queues[w].tasks.pop_back();
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < threads; ++i) {
+                Queue &victim = queues[(w + i) % threads];
+                std::deque<size_t> stolen;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    size_t half = (victim.tasks.size() + 1) / 2;
+                    stolen.assign(victim.tasks.begin(),
+                                  victim.tasks.begin() + half);
+                    victim.tasks.erase(victim.tasks.begin(),
+                                       victim.tasks.begin() + half);
+                }
+                if (!stolen.empty()) {
+                    task = stolen.back();
+                    stolen.pop_back();
+                    std::lock_guard<std::mutex> lock(queues[w].mutex);
+                    queues[w].tasks.insert(queues[w].tasks.end(),
+                                           stolen.begin(), stolen.end());
+                    return true;
+                }
+            }
+            return false; // tasks are never added, so nothing is left
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t w = 0; w < threads; ++w) {
+            pool.emplace_back([&, w] {
+                size_t task;
+                while (next(w, task)) {
+                    work(w, task);
+                }
+            });
+        }
+        for (auto &thread : pool) {
+            thread.join();
+        }
+    }
+};
+
+// The files a batch covers: every regular file under a directory whose
+// extension is in `extensions`, or the paths listed one per line in a file.
+inline std::vector<std::string>
+collectBatchFiles(const std::string &source,
+                  std::initializer_list<const char *> extensions) {
+    std::vector<std::string> files;
+    std::error_code error;
+    if (std::filesystem::is_directory(source, error)) {
+        for (auto it = std::filesystem::recursive_directory_iterator(
+                 source,
+                 std::filesystem::directory_options::skip_permission_denied,
+                 error);
+             it != std::filesystem::recursive_directory_iterator();
+             it.increment(error)) {
+            if (error || !it->is_regular_file(error)) {
+                continue;
+            }
+            std::string extension = it->path().extension().string();
+            std::transform(extension.begin(), extension.end(),
+                           extension.begin(), ::tolower);
+            for (const char *wanted : extensions) {
+                if (extension == wanted) {
+                    files.push_back(it->path().string());
+                    break;
+                }
+            }
+        }
+        std::sort(files.begin(), files.end());
+    } else {
+        std::ifstream list(source);
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                files.push_back(line);
+            }
+        }
+    }
+    return files;
+}
@@ -0,0 +1,107 @@
+// Benchmark support shared by gif_parser --bench and mp4_parser --bench.
+//
+// BenchReport collects one record per measurement, prints nothing itself
+// and saves the records as JSON, so runs of different versions can be
+// compared. Built with -DPARSER_BENCH (the `bench` make target), the global
+// operator new is replaced by a counting one and records carry the number
+// of heap allocations; without it allocation counts are left out.
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json.h"
+
+#ifdef PARSER_BENCH
+inline std::atomic<size_t> heapAllocations{0};
+
+void *operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t align = static_cast<size_t>(alignment);
+    size = (size + align - 1) / align * align;
+    if (void *p = std::aligned_alloc(align, size ? size : align)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// out of line, or GCC pairs the inlined free() with new and warns
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete(void *p, std::align_val_t) noexcept { operator delete(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+#endif
+
+// Heap allocations since the start of the process, or -1 when they are not
+// counted.
+inline long long allocationCount() {
+#ifdef PARSER_BENCH
+    return static_cast<long long>(heapAllocations.load());
+#else
+    return -1;
+#endif
+}
+
+struct BenchReport {
+    std::vector<std::string> records;
+
+    // add("synthetic 4096x4096", "decode", {{"mb_per_s", 84.4}, ...});
+    // negative values (an allocation count that was not taken) are skipped
+    void add(const std::string &input, const std::string &benchmark,
+             std::initializer_list<std::pair<const char *, double>> metrics) {
+        std::string record = "{\"input\":";
+        appendJson(record, input);
+        record += ",\"benchmark\":";
+        appendJson(record, benchmark);
+        for (const auto &[key, value] : metrics) {
+            if (value < 0) {
+                continue;
+            }
+            char number[32];
+            std::snprintf(number, sizeof(number), "%.6g", value);
+            record += ",\"";
+            record += key;
+            record += "\":";
+            record += number;
+        }
+        record += "}";
+        records.push_back(std::move(record));
+    }
+
+    bool save(const std::string &path, const std::string &tool) const {
+        std::string json = "{\"tool\":";
+        appendJson(json, tool);
+        json += ",\"version\":";
+        appendJson(json, PARSER_VERSION);
+        json += ",\"allocations_counted\":";
+        json += allocationCount() >= 0 ? "true" : "false";
+        json += ",\"results\":[\n";
+        for (size_t i = 0; i < records.size(); ++i) {
+            json += records[i];
+            json += i + 1 < records.size() ? ",\n" : "\n";
+        }
+        json += "]}\n";
+        FILE *out = std::fopen(path.c_str(), "w");
+        if (!out) {
+            return false;
+        }
+        bool ok = std::fwrite(json.data(), 1, json.size(), out) == json.size();
+        return std::fclose(out) == 0 && ok;
+    }
+};
@@ -0,0 +1,446 @@
+// Prefetching read-only file access shared by gif_parser and mp4_parser.
+//
+// A ByteSource gives the parsers one contiguous pointer over the whole file,
+// the way an mmap would, but fills it with large block-aligned reads that
+// are queued ahead of the cursor on an io_uring: the kernel reads block
+// k + 1 while the parser is still inside block k. ensure() is the only call
+// that can block, and only when the parser catches up with the reads.
+//
+// When io_uring is not available (old kernels, seccomp, io_uring_disabled)
+// the file is mmapped instead and ensure() returns at once, with the
+// kernel's own readahead doing the prefetching; files that cannot be
+// mapped are read into memory.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "parse_stats.h"
+
+// The part of io_uring the sources need, on the raw system calls: queue
+// reads, submit them, reap completions. Single-threaded.
+struct IoUring {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned queued = 0; // filled but not yet submitted
+    void *sqRing = nullptr;
+    size_t sqRingSize = 0;
+    void *cqRing = nullptr;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+    ~IoUring() { close(); }
+
+    bool init(unsigned depth) {
+        io_uring_params params = {};
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (fd < 0) {
+            return false;
+        }
+        entries = params.sq_entries;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            sqRing = nullptr;
+            close();
+            return false;
+        }
+        cqRing = single ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd,
+                               IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = nullptr;
+            close();
+            return false;
+        }
+        void *s = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQES);
+        if (s == MAP_FAILED) {
+            close();
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(s);
+
+        auto *sq = static_cast<uint8_t *>(sqRing);
+        auto *cq = static_cast<uint8_t *>(cqRing);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void close() {
+        if (sqes) {
+            munmap(sqes, entries * sizeof(io_uring_sqe));
+            sqes = nullptr;
+        }
+        if (cqRing && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing) {
+            munmap(sqRing, sqRingSize);
+        }
+        sqRing = cqRing = nullptr;
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        queued = 0;
+    }
+
+    // false when the submission queue is full
+    bool queueRead(int file, void *buffer, uint32_t length, uint64_t offset,
+                   uint64_t tag) {
+        unsigned tail = *sqTail;
+        unsigned head = std::atomic_ref<unsigned>(*sqHead).load(
+            std::memory_order_acquire);
+        if (tail - head >= entries) {
+            return false;
+        }
+        unsigned index = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sqArray[index] = index;
+        std::atomic_ref<unsigned>(*sqTail).store(tail + 1,
+                                                 std::memory_order_release);
+        ++queued;
+        return true;
+    }
+
+    // submits what was queued and, with `wait`, blocks for one completion
+    bool submit(bool wait) {
+        if (!wait && queued == 0) {
+            return true;
+        }
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        while (true) {
+            long n = syscall(__NR_io_uring_enter, fd, queued, wait ? 1 : 0,
+                             flags, nullptr, 0);
+            if (statsEnabled()) {
+                ++parseStats().ringEnters;
+            }
+            if (n >= 0) {
+                queued -= std::min<unsigned>(queued, n);
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // false when no completion is waiting
+    bool reap(uint64_t &tag, int32_t &result) {
+        unsigned head = *cqHead;
+        unsigned tail = std::atomic_ref<unsigned>(*cqTail).load(
+            std::memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        const io_uring_cqe &cqe = cqes[head & *cqMask];
+        tag = cqe.user_data;
+        result = cqe.res;
+        std::atomic_ref<unsigned>(*cqHead).store(head + 1,
+                                                 std::memory_order_release);
+        return true;
+    }
+};
+
+struct ByteSource {
+    enum class Backend { Auto, Mapped };
+
+    // bytes per read; every read starts at a multiple of it
+    size_t blockSize = 256 << 10;
+    // blocks kept in flight past the last one asked for
+    size_t readahead = 8;
+
+    ByteSource() = default;
+    ByteSource(const ByteSource &) = delete;
+    ByteSource &operator=(const ByteSource &) = delete;
+    ~ByteSource() { close(); }
+
+    const uint8_t *data() const { return base; }
+    uint64_t size() const { return length; }
+    bool prefetching() const { return ring.fd >= 0; }
+    const char *backend() const {
+        return prefetching() ? "io_uring" : mapping ? "mmap" : "read";
+    }
+
+    bool open(const std::string &path, Backend backend = Backend::Auto) {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            length = st.st_size;
+            if (length == 0) {
+                return true;
+            }
+            if (backend == Backend::Auto && openRing()) {
+                return true;
+            }
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, length, MADV_SEQUENTIAL);
+                mapping = p;
+                mappingSize = length;
+                base = static_cast<uint8_t *>(p);
+                return true;
+            }
+        }
+        uint8_t chunk[1 << 16];
+        ssize_t n;
+        while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+            buffer.insert(buffer.end(), chunk, chunk + n);
+            countRead(n);
+        }
+        base = buffer.data();
+        length = buffer.size();
+        return n == 0;
+    }
+
+    void close() {
+        if (prefetching()) {
+            // the kernel may still be writing into `mapping`
+            while (inFlight > 0 && ring.submit(true)) {
+                reapAll();
+            }
+            ring.close();
+        }
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        buffer.clear();
+        state.clear();
+        base = nullptr;
+        length = 0;
+        inFlight = 0;
+        discarded = 0;
+    }
+
+    // Blocks until [offset, offset + n) is in memory and queues the
+    // readahead after it. Returns where the bytes that are in memory from
+    // `offset` on end, which is past offset + n unless the file is shorter
+    // or a read failed.
+    uint64_t ensure(uint64_t offset, size_t n) {
+        if (!prefetching()) {
+            return length;
+        }
+        if (offset >= length) {
+            return length;
+        }
+        uint64_t end = std::min<uint64_t>(offset + std::max<size_t>(n, 1),
+                                          length);
+        size_t first = offset / blockSize;
+        size_t last = (end - 1) / blockSize;
+        queue(first, last, true);
+        queue(last + 1, last + readahead, false);
+        ring.submit(false);
+        for (size_t b = first; b <= last; ++b) {
+            while (state[b] == InFlight) {
+                if (!ring.submit(true)) {
+                    readBlock(b);
+                    break;
+                }
+                reapAll();
+            }
+            if (state[b] != Ready) {
+                return std::max<uint64_t>(b * blockSize, offset);
+            }
+        }
+        size_t resident = last + 1;
+        while (resident < state.size() && state[resident] == Ready) {
+            ++resident;
+        }
+        return std::min<uint64_t>(resident * blockSize, length);
+    }
+
+    // Starts reading [offset, offset + n) without waiting for it: the
+    // next ensure() there finds it in memory or already on its way.
+    void willNeed(uint64_t offset, size_t n) {
+        if (offset >= length || n == 0) {
+            return;
+        }
+        uint64_t end = std::min<uint64_t>(offset + n, length);
+        if (!prefetching()) {
+            if (mapping) {
+                uint64_t page = offset & ~uint64_t(sysconf(_SC_PAGESIZE) - 1);
+                madvise(base + page, end - page, MADV_WILLNEED);
+            }
+            return;
+        }
+        queue(offset / blockSize, (end - 1) / blockSize, false);
+        ring.submit(false);
+    }
+
+    // Gives back the memory of the whole blocks before `offset`, for
+    // readers that never look back; they are read again if asked for.
+    void discard(uint64_t offset) {
+        size_t blocks = std::min<uint64_t>(offset, length) / blockSize;
+        if (blocks == 0 || buffer.size()) {
+            return;
+        }
+        if (prefetching()) {
+            size_t b = discarded;
+            while (b < blocks && state[b] != InFlight) {
+                state[b++] = Empty;
+            }
+            blocks = b;
+        }
+        if (blocks > discarded) {
+            madvise(base + discarded * blockSize,
+                    (blocks - discarded) * blockSize, MADV_DONTNEED);
+            discarded = blocks;
+        }
+    }
+
+  private:
+    enum : uint8_t { Empty, InFlight, Ready, Failed };
+
+    int fd = -1;
+    uint64_t length = 0;
+    uint8_t *base = nullptr;
+    void *mapping = nullptr; // the file, or the blocks reads land in
+    size_t mappingSize = 0;
+    std::vector<uint8_t> buffer;
+    IoUring ring;
+    std::vector<uint8_t> state; // per block
+    size_t inFlight = 0;
+    size_t discarded = 0; // blocks before this were given back
+
+    bool openRing() {
+        if (!ring.init(32)) {
+            return false;
+        }
+        // Reads land at their file offset in an anonymous mapping as big as
+        // the file; blocks that are never asked for cost no memory.
+        size_t blocks = (length + blockSize - 1) / blockSize;
+        mappingSize = blocks * blockSize;
+        void *p = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            ring.close();
+            return false;
+        }
+        mapping = p;
+        base = static_cast<uint8_t *>(p);
+        state.assign(blocks, Empty);
+        return true;
+    }
+
+    size_t blockLength(size_t b) const {
+        return std::min<uint64_t>(blockSize, length - b * blockSize);
+    }
+
+    // Queues the empty blocks of [first, last]. Blocks that are needed
+    // wait for room in the ring; readahead stops when it is full.
+    void queue(size_t first, size_t last, bool needed) {
+        last = std::min(last, state.size() - 1);
+        for (size_t b = first; b <= last && b < state.size(); ++b) {
+            if (state[b] != Empty) {
+                continue;
+            }
+            bool queued = false;
+            while (true) {
+                if (inFlight < ring.entries &&
+                    ring.queueRead(fd, base + b * blockSize, blockLength(b),
+                                   b * blockSize, b)) {
+                    queued = true;
+                    break;
+                }
+                if (!needed) {
+                    return;
+                }
+                if (!ring.submit(true)) {
+                    readBlock(b);
+                    break;
+                }
+                reapAll();
+            }
+            if (queued) {
+                state[b] = InFlight;
+                ++inFlight;
+            }
+        }
+    }
+
+    void reapAll() {
+        uint64_t b;
+        int32_t result;
+        while (ring.reap(b, result)) {
+            --inFlight;
+            if (statsEnabled() && result > 0) {
+                parseStats().bytesRead += result;
+            }
+            // short reads and errors (say, a kernel without IORING_OP_READ)
+            // are finished with pread
+            if (result != static_cast<int32_t>(blockLength(b))) {
+                readBlock(b, result > 0 ? result : 0);
+            } else {
+                state[b] = Ready;
+            }
+        }
+    }
+
+    void readBlock(size_t b, size_t done = 0) {
+        size_t want = blockLength(b);
+        while (done < want) {
+            ssize_t n = pread(fd, base + b * blockSize + done, want - done,
+                              b * blockSize + done);
+            countRead(n > 0 ? n : 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                state[b] = Failed;
+                return;
+            }
+            done += n;
+        }
+        state[b] = Ready;
+    }
+};
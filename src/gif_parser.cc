@@ -1,19 +1,147 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
+#include "arena.h"
+#include "batch.h"
+#include "bench.h"
+#include "byte_source.h"
+#include "json.h"
+#include "parse_stats.h"
+#include "source_key.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Raw byte cursor over an in-memory GIF. Reading past the end zero-fills
+// and puts the cursor into the failed state, like an istream would. Over a
+// prefetching ByteSource only the bytes before `ready` are known to be in
+// memory; peek() and read() wait for the rest, skip() does not need to.
+struct ByteCursor {
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+    bool failed = false;
+    size_t ready;
+    ByteSource *source = nullptr;
+
+    ByteCursor(const uint8_t *data, size_t size)
+        : data(data), size(size), ready(size) {}
+    explicit ByteCursor(ByteSource &source)
+        : data(source.data()), size(source.size()), ready(0),
+          source(&source) {}
+
+    size_t tell() const { return pos; }
+    size_t remaining() const { return size - pos; }
+    explicit operator bool() const { return !failed; }
+
+    // returns -1 past the end
+    int peek(size_t ahead = 0) {
+        if (pos + ahead >= ready && !fetch(pos + ahead, 1)) {
+            return -1;
+        }
+        return data[pos + ahead];
+    }
+
+    ByteCursor &read(void *out, size_t n) {
+        if (n > remaining() || (pos + n > ready && !fetch(pos, n))) {
+            std::memset(out, 0, n);
+            pos = size;
+            failed = true;
+            return *this;
+        }
+        std::memcpy(out, data + pos, n);
+        pos += n;
+        return *this;
+    }
+
+    ByteCursor &skip(size_t n) {
+        if (n > remaining()) {
+            pos = size;
+            failed = true;
+        } else {
+            pos += n;
+        }
+        return *this;
+    }
+
+    // Waits for [offset, offset + n) to arrive; false past the end, or
+    // when the file could not be read that far (which ends it there).
+    bool fetch(size_t offset, size_t n) {
+        if (offset + n > size) {
+            return false;
+        }
+        if (source) {
+            ready = source->ensure(offset, n);
+            if (ready < offset + n) {
+                size = std::max(ready, pos);
+                return false;
+            }
+        }
+        return offset + n <= ready;
+    }
+};
+
+// Appends a field as it is laid out in memory: the inverse of
+// ByteCursor::read, which GIF's little-endian numbers rely on as well.
+template <typename T> void appendField(std::string &out, const T &field) {
+    out.append(reinterpret_cast<const char *>(&field), sizeof(field));
+}
+
+// The 3-bit size field of a color table with room for `entries` colors:
+// the table holds 2 << bits entries.
+uint8_t colorTableBits(int entries) {
+    uint8_t bits = 0;
+    while ((2 << bits) < entries && bits < 7) {
+        ++bits;
+    }
+    return bits;
+}
+
 struct Header {
     char signature[3];
     char version[3];
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(signature, sizeof(signature));
         input.read(version, sizeof(version));
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
+
+    void write(std::string &out) const {
+        out.append(signature, sizeof(signature));
+        out.append(version, sizeof(version));
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const Header &d) {
@@ -39,8 +167,8 @@ struct LogicalScreenDescriptor {
     int beginPosition;
     int endPosition;
 
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&logicalScreenWidth),
                    sizeof(logicalScreenWidth));
         input.read(reinterpret_cast<char *>(&logicalScreenHeight),
@@ -51,16 +179,32 @@ struct LogicalScreenDescriptor {
                    sizeof(backgroundColorIndex));
         input.read(reinterpret_cast<char *>(&pixelAspectRatio),
                    sizeof(pixelAspectRatio));
-        endPosition = input.tellg();
+        endPosition = input.tell();
         parsepackedFields();
         return input;
     }
 
     void parsepackedFields() {
         globalColorTableFlag = (packedFields & 0b1000'0000) >> 7;
-        colorResolution = (1 >> ((packedFields & 0b0111'0000) >> 4)) - 1;
+        colorResolution = ((packedFields & 0b0111'0000) >> 4) + 1;
         sortFlag = (packedFields & 0b0000'1000) >> 3;
-        sizeOfGlobalColorTable = (1 >> ((packedFields & 0b0000'0111))) - 1;
+        // stored as (entries - 1) so that a 256-entry table fits in a byte
+        sizeOfGlobalColorTable = (1 << ((packedFields & 0b0000'0111) + 1)) - 1;
+    }
+
+    // the inverse of parsepackedFields()
+    void packFields() {
+        packedFields = globalColorTableFlag << 7 |
+                       ((colorResolution - 1) & 0b111) << 4 | sortFlag << 3 |
+                       colorTableBits(sizeOfGlobalColorTable + 1);
+    }
+
+    void write(std::string &out) const {
+        appendField(out, logicalScreenWidth);
+        appendField(out, logicalScreenHeight);
+        appendField(out, packedFields);
+        appendField(out, backgroundColorIndex);
+        appendField(out, pixelAspectRatio);
     }
 };
 
@@ -83,93 +227,273 @@ std::ostream &operator<<(std::ostream &os, const LogicalScreenDescriptor &d) {
     return os;
 }
 
-struct Color {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-    int beginPosition;
-    int endPosition;
-
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
-        input.read(reinterpret_cast<char *>(&red), sizeof(red));
-        input.read(reinterpret_cast<char *>(&green), sizeof(green));
-        input.read(reinterpret_cast<char *>(&blue), sizeof(blue));
-        endPosition = input.tellg();
-        return input;
-    }
+enum class PixelFormat {
+    RGBA, // R, G, B, A in memory order
+    BGRA,
 };
 
+// A color table packed into 256-entry lookup tables of 32-bit pixels, built
+// once when the table is parsed. Entries past `size` are transparent black.
 struct ColorTable {
-    std::vector<Color> colors;
-    int beginPosition;
-    int endPosition;
-    std::istream &parse(std::istream &input, int size) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
-        colors = std::vector<Color>(size);
+    uint16_t size = 0;
+    alignas(32) uint32_t rgba[256] = {};
+    alignas(32) uint32_t bgra[256] = {};
+    int beginPosition = 0;
+    int endPosition = 0;
+    ByteCursor &parse(ByteCursor &input, int size) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
+        this->size = static_cast<uint16_t>(size);
+        uint8_t rgb[256 * 3];
+        input.read(rgb, 3 * size);
         for (int i = 0; i < size; ++i) {
-            colors[i].parse(input);
+            uint32_t r = rgb[3 * i];
+            uint32_t g = rgb[3 * i + 1];
+            uint32_t b = rgb[3 * i + 2];
+            rgba[i] = r | g << 8 | b << 16 | 0xFF000000u;
+            bgra[i] = b | g << 8 | r << 16 | 0xFF000000u;
         }
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
+
+    const uint32_t *lut(PixelFormat format) const {
+        return format == PixelFormat::RGBA ? rgba : bgra;
+    }
+
+    void set(int i, uint8_t r, uint8_t g, uint8_t b) {
+        rgba[i] = r | g << 8 | b << 16 | 0xFF000000u;
+        bgra[i] = b | g << 8 | r << 16 | 0xFF000000u;
+    }
+
+    // Writes the 2 << colorTableBits(size) entries the packed fields
+    // announce; the ones past `size` are black.
+    void write(std::string &out) const {
+        int entries = 2 << colorTableBits(size);
+        for (int i = 0; i < entries; ++i) {
+            uint32_t color = i < size ? rgba[i] : 0;
+            out.push_back(static_cast<char>(color & 0xFF));
+            out.push_back(static_cast<char>(color >> 8 & 0xFF));
+            out.push_back(static_cast<char>(color >> 16 & 0xFF));
+        }
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const ColorTable &d) {
     os << "ColorTable("
        << "position=[" << d.beginPosition << "," << d.endPosition << "],"
-       << "size=" << d.colors.size() //
+       << "size=" << d.size //
        << ")";
     return os;
 }
 
+// Row kernels that turn color indices into pixels through a ColorTable
+// lookup table. expand() writes every pixel; composite() leaves the
+// destination pixel alone where the index is the transparent one. The widest
+// variant the CPU supports is picked at runtime by best().
+struct PaletteKernels {
+    const char *name;
+    void (*expand)(const uint8_t *indices, size_t count, const uint32_t *lut,
+                   uint32_t *out);
+    void (*composite)(const uint8_t *indices, size_t count,
+                      const uint32_t *lut, uint8_t transparentIndex,
+                      uint32_t *out);
+
+    static const PaletteKernels &best();
+    static std::vector<const PaletteKernels *> supported();
+};
+
+void expandScalar(const uint8_t *indices, size_t count, const uint32_t *lut,
+                  uint32_t *out) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        out[i] = lut[indices[i]];
+        out[i + 1] = lut[indices[i + 1]];
+        out[i + 2] = lut[indices[i + 2]];
+        out[i + 3] = lut[indices[i + 3]];
+    }
+    for (; i < count; ++i) {
+        out[i] = lut[indices[i]];
+    }
+}
+
+void compositeScalar(const uint8_t *indices, size_t count, const uint32_t *lut,
+                     uint8_t transparentIndex, uint32_t *out) {
+    for (size_t i = 0; i < count; ++i) {
+        if (indices[i] != transparentIndex) {
+            out[i] = lut[indices[i]];
+        }
+    }
+}
+
+const PaletteKernels scalarPaletteKernels = {"scalar", expandScalar,
+                                             compositeScalar};
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE4.1 has no gather, so its expand() is the scalar one: four lookups
+// and a vector store bought nothing over four scalar stores. composite()
+// keeps a blend, which takes no branch per pixel however the transparent
+// pixels are scattered.
+__attribute__((target("sse4.1"))) void
+compositeSse4(const uint8_t *indices, size_t count, const uint32_t *lut,
+              uint8_t transparentIndex, uint32_t *out) {
+    const __m128i transparent = _mm_set1_epi32(transparentIndex);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t four;
+        std::memcpy(&four, indices + i, sizeof(four));
+        __m128i index = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(four));
+        __m128i pixels = _mm_setr_epi32(lut[indices[i]], lut[indices[i + 1]],
+                                        lut[indices[i + 2]],
+                                        lut[indices[i + 3]]);
+        __m128i *dst = reinterpret_cast<__m128i *>(out + i);
+        __m128i keep = _mm_cmpeq_epi32(index, transparent);
+        _mm_storeu_si128(
+            dst, _mm_blendv_epi8(pixels, _mm_loadu_si128(dst), keep));
+    }
+    compositeScalar(indices + i, count - i, lut, transparentIndex, out + i);
+}
+
+// AVX2 widens 8 indices and gathers their pixels in one instruction.
+__attribute__((target("avx2"))) void expandAvx2(const uint8_t *indices,
+                                                size_t count,
+                                                const uint32_t *lut,
+                                                uint32_t *out) {
+    const int *table = reinterpret_cast<const int *>(lut);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(indices + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                            _mm256_i32gather_epi32(table, index, 4));
+    }
+    expandScalar(indices + i, count - i, lut, out + i);
+}
+
+__attribute__((target("avx2"))) void
+compositeAvx2(const uint8_t *indices, size_t count, const uint32_t *lut,
+              uint8_t transparentIndex, uint32_t *out) {
+    const int *table = reinterpret_cast<const int *>(lut);
+    const __m256i transparent = _mm256_set1_epi32(transparentIndex);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(indices + i)));
+        __m256i pixels = _mm256_i32gather_epi32(table, index, 4);
+        __m256i *dst = reinterpret_cast<__m256i *>(out + i);
+        __m256i keep = _mm256_cmpeq_epi32(index, transparent);
+        _mm256_storeu_si256(
+            dst, _mm256_blendv_epi8(pixels, _mm256_loadu_si256(dst), keep));
+    }
+    compositeScalar(indices + i, count - i, lut, transparentIndex, out + i);
+}
+
+const PaletteKernels sse4PaletteKernels = {"sse4.1", expandScalar,
+                                           compositeSse4};
+const PaletteKernels avx2PaletteKernels = {"avx2", expandAvx2, compositeAvx2};
+#endif
+
+std::vector<const PaletteKernels *> PaletteKernels::supported() {
+    std::vector<const PaletteKernels *> kernels = {&scalarPaletteKernels};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        kernels.push_back(&sse4PaletteKernels);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&avx2PaletteKernels);
+    }
+#endif
+    return kernels;
+}
+
+const PaletteKernels &PaletteKernels::best() {
+    static const PaletteKernels *kernels = supported().back();
+    return *kernels;
+}
+
+// A data sub-block as a view into the file: the payload is the `size`
+// bytes at `offset`, right after the length byte.
 struct SubBlock {
     uint8_t size;
-    std::vector<uint8_t> data;
+    size_t offset;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&size), sizeof(size));
-        if (size == 0) {
-            return input;
-        }
-        data.reserve(size);
-        input.read(reinterpret_cast<char *>(data.data()), size);
-        endPosition = input.tellg();
+        offset = input.tell();
+        input.skip(size);
+        endPosition = input.tell();
         return input;
     }
+
+    const uint8_t *data(const uint8_t *bytes) const { return bytes + offset; }
 };
 
 std::ostream &operator<<(std::ostream &os, const SubBlock &d) {
     os << "SubBlock("
        << "position=[" << d.beginPosition << "," << d.endPosition << "],"
-       << "size=" << +d.size; //
-    os << std::hex << std::showbase;
-    for (const auto &u : d.data) {
-        os << static_cast<int>(u);
-    }
-    os << std::resetiosflags(std::ios::hex | std::ios::showbase) //
+       << "size=" << +d.size //
        << ")";
     return os;
 }
 
+// A chain of data sub-blocks up to and including the block terminator, kept
+// as a view into the file instead of a list of copied payloads.
+struct SubBlockChain {
+    size_t offset;     // first length byte
+    size_t length;     // bytes spanned, length bytes and terminator included
+    size_t blockCount; // data sub-blocks, terminator excluded
+    size_t dataSize;   // payload bytes
+    int beginPosition;
+    int endPosition;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
+        offset = input.tell();
+        blockCount = 0;
+        dataSize = 0;
+        while (true) {
+            int size = input.peek();
+            if (size < 0) {
+                input.skip(1); // sets the failed state
+                break;
+            }
+            input.skip(size + 1);
+            if (size == 0) {
+                break;
+            }
+            ++blockCount;
+            dataSize += size;
+        }
+        length = input.tell() - offset;
+        endPosition = input.tell();
+        return input;
+    }
+};
+
 // <Logical Screen> ::=      Logical Screen Descriptor [Global Color Table]
 struct LogicScreen {
     LogicalScreenDescriptor logicalScreenDescriptor;
     ColorTable globalColorTabel;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         logicalScreenDescriptor.parse(input);
         if (logicalScreenDescriptor.globalColorTableFlag) {
             globalColorTabel.parse(
                 input, logicalScreenDescriptor.sizeOfGlobalColorTable + 1);
         }
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
+
+    void write(std::string &out) const {
+        logicalScreenDescriptor.write(out);
+        if (logicalScreenDescriptor.globalColorTableFlag) {
+            globalColorTabel.write(out);
+        }
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const LogicScreen &d) {
@@ -185,9 +509,9 @@ std::ostream &operator<<(std::ostream &os, const LogicScreen &d) {
 struct PlainTextExtension {
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
-        endPosition = input.tellg();
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
+        endPosition = input.tell();
         return input;
     }
 };
@@ -199,33 +523,272 @@ std::ostream &operator<<(std::ostream &os, const PlainTextExtension &d) {
     return os;
 }
 
+// Reads variable-width LZW codes (LSB first) straight out of a sub-block
+// chain in the file. Bytes are pulled into a 64-bit accumulator, so a code
+// is one mask and one shift most of the time.
+struct LzwCodeReader {
+    const uint8_t *cursor;
+    const uint8_t *blockEnd;
+    const uint8_t *chainEnd;
+    uint64_t bits = 0;
+    int bitCount = 0;
+
+    LzwCodeReader(const uint8_t *bytes, const SubBlockChain &chain)
+        : cursor(bytes + chain.offset), blockEnd(cursor),
+          chainEnd(cursor + chain.length) {}
+
+    void refill() {
+        while (bitCount <= 56) {
+            if (cursor == blockEnd) {
+                if (cursor >= chainEnd || *cursor == 0) {
+                    return;
+                }
+                size_t size = *cursor++;
+                blockEnd = std::min(cursor + size, chainEnd);
+                continue;
+            }
+            bits |= static_cast<uint64_t>(*cursor++) << bitCount;
+            bitCount += 8;
+        }
+    }
+
+    // returns -1 when the sub-block chain runs out
+    int read(int codeSize) {
+        if (bitCount < codeSize) {
+            refill();
+            if (bitCount < codeSize) {
+                return -1;
+            }
+        }
+        int code = static_cast<int>(bits & ((1u << codeSize) - 1));
+        bits >>= codeSize;
+        bitCount -= codeSize;
+        return code;
+    }
+};
+
+// Table-driven LZW decoder. Every code keeps its prefix code, its last byte,
+// its first byte and its length in flat arrays, so a string is written
+// backwards straight into the output buffer: no stack, no allocation.
+struct LzwDecoder {
+    static constexpr int maxCodes = 4096;
+    static constexpr int maxCodeSize = 12;
+    uint16_t prefix[maxCodes];
+    uint8_t suffix[maxCodes];
+    uint8_t first[maxCodes];
+    uint16_t length[maxCodes];
+
+    // Decodes into `out` and returns the number of indices written; pixels
+    // the stream does not cover are left untouched.
+    size_t decode(uint8_t lzwMinimumCodeSize, const uint8_t *bytes,
+                  const SubBlockChain &chain, uint8_t *out, size_t outSize) {
+        if (lzwMinimumCodeSize < 2 || lzwMinimumCodeSize > 11) {
+            return 0;
+        }
+        const int clearCode = 1 << lzwMinimumCodeSize;
+        const int endCode = clearCode + 1;
+        for (int i = 0; i < clearCode; ++i) {
+            prefix[i] = 0;
+            suffix[i] = static_cast<uint8_t>(i);
+            first[i] = static_cast<uint8_t>(i);
+            length[i] = 1;
+        }
+
+        LzwCodeReader reader(bytes, chain);
+        int codeSize = lzwMinimumCodeSize + 1;
+        int nextCode = endCode + 1;
+        int prev = -1;
+        size_t pos = 0;
+
+        while (pos < outSize) {
+            int code = reader.read(codeSize);
+            if (code < 0 || code == endCode) {
+                break;
+            }
+            if (code == clearCode) {
+                codeSize = lzwMinimumCodeSize + 1;
+                nextCode = endCode + 1;
+                prev = -1;
+                continue;
+            }
+            if (prev < 0) {
+                if (code > clearCode) {
+                    break; // corrupt stream
+                }
+                out[pos++] = suffix[code];
+                prev = code;
+                continue;
+            }
+            if (code > nextCode || (code == nextCode && nextCode == maxCodes)) {
+                break; // corrupt stream
+            }
+            if (nextCode < maxCodes) {
+                // for code == nextCode (KwKwK) the entry is completed here,
+                // before it is written out
+                uint8_t c = code == nextCode ? first[prev] : first[code];
+                prefix[nextCode] = static_cast<uint16_t>(prev);
+                suffix[nextCode] = c;
+                first[nextCode] = first[prev];
+                length[nextCode] = length[prev] + 1;
+                ++nextCode;
+                if (nextCode == (1 << codeSize) && codeSize < maxCodeSize) {
+                    ++codeSize;
+                }
+            }
+
+            size_t len = length[code];
+            int c = code;
+            if (pos + len <= outSize) {
+                uint8_t *dst = out + pos + len - 1;
+                for (size_t i = 0; i < len; ++i) {
+                    *dst-- = suffix[c];
+                    c = prefix[c];
+                }
+                pos += len;
+            } else {
+                // clipped: drop the tail that falls outside the frame
+                for (size_t i = len; i > 0; --i) {
+                    if (pos + i - 1 < outSize) {
+                        out[pos + i - 1] = suffix[c];
+                    }
+                    c = prefix[c];
+                }
+                pos = outSize;
+            }
+            prev = code;
+        }
+        return pos;
+    }
+};
+
+// LZW encoder for Image Data. The string table is an open-addressing hash
+// from (prefix code, next index) to code, one 32-bit word per slot holding
+// both, so the whole table is 64 KiB and a clear code resets it with one
+// memset. Codes are packed LSB first into a flat buffer 32 bits at a time,
+// which is cut into sub-blocks at the end.
+struct LzwEncoder {
+    static constexpr int maxCodes = 4096;
+    static constexpr int maxCodeSize = 12;
+    static constexpr int hashBits = 14; // four slots per code: short probes
+    static constexpr uint32_t hashMask = (1u << hashBits) - 1;
+
+    size_t blockSize = 255; // data bytes per sub-block, 1 to 255
+    uint32_t table[1 << hashBits]; // key << 12 | code, 0 when free
+
+    // Appends the sub-blocks, terminator included, that decode to
+    // `indices`; every index must be below 1 << minCodeSize.
+    void encode(const uint8_t *indices, size_t count, int minCodeSize,
+                std::string &out) {
+        const int clearCode = 1 << minCodeSize;
+        const int endCode = clearCode + 1;
+        int codeSize = minCodeSize + 1;
+        int nextCode = endCode + 1;
+        // at most one code per index, plus clear codes, of 12 bits each
+        packed.resize(count * 2 + count / 1024 * 4 + 16);
+        cursor = packed.data();
+        bits = 0;
+        bitCount = 0;
+        std::memset(table, 0, sizeof(table));
+        emit(clearCode, codeSize);
+
+        uint32_t prefix = count > 0 ? indices[0] : 0;
+        for (size_t i = 1; i < count; ++i) {
+            uint32_t key = prefix << 8 | indices[i];
+            uint32_t slot = (key * 2654435761u) >> (32 - hashBits);
+            uint32_t entry;
+            while ((entry = table[slot]) != 0 && entry >> 12 != key) {
+                slot = (slot + 1) & hashMask;
+            }
+            if (entry != 0) {
+                prefix = entry & 0xFFF;
+                continue;
+            }
+            emit(prefix, codeSize);
+            if (nextCode < maxCodes) {
+                // codes are never below endCode + 1, so 0 still means free
+                table[slot] = key << 12 | static_cast<uint32_t>(nextCode++);
+                if (nextCode > (1 << codeSize) && codeSize < maxCodeSize) {
+                    ++codeSize;
+                }
+            } else {
+                emit(clearCode, codeSize);
+                std::memset(table, 0, sizeof(table));
+                codeSize = minCodeSize + 1;
+                nextCode = endCode + 1;
+            }
+            prefix = indices[i];
+        }
+        if (count > 0) {
+            emit(prefix, codeSize);
+        }
+        emit(endCode, codeSize);
+        while (bitCount > 0) {
+            *cursor++ = static_cast<uint8_t>(bits);
+            bits >>= 8;
+            bitCount -= 8;
+        }
+
+        const uint8_t *p = packed.data();
+        size_t size = cursor - p;
+        size_t blocks = (size + blockSize - 1) / blockSize;
+        out.reserve(out.size() + size + blocks + 1);
+        for (size_t done = 0; done < size; done += blockSize) {
+            size_t n = std::min(blockSize, size - done);
+            out.push_back(static_cast<char>(n));
+            out.append(reinterpret_cast<const char *>(p + done), n);
+        }
+        out.push_back(0);
+    }
+
+  private:
+    std::vector<uint8_t> packed;
+    uint8_t *cursor = nullptr;
+    uint64_t bits = 0;
+    int bitCount = 0;
+
+    void emit(int code, int codeSize) {
+        bits |= static_cast<uint64_t>(code) << bitCount;
+        bitCount += codeSize;
+        if (bitCount >= 32) {
+            // four separate stores that compilers merge into one
+            cursor[0] = static_cast<uint8_t>(bits);
+            cursor[1] = static_cast<uint8_t>(bits >> 8);
+            cursor[2] = static_cast<uint8_t>(bits >> 16);
+            cursor[3] = static_cast<uint8_t>(bits >> 24);
+            cursor += 4;
+            bits >>= 32;
+            bitCount -= 32;
+        }
+    }
+};
+
 struct TableBasedImageData {
     uint8_t lzwMinimumCodeSize;
-    std::vector<SubBlock> imageData;
+    SubBlockChain imageData;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&lzwMinimumCodeSize),
                    sizeof(lzwMinimumCodeSize));
-        while (true) {
-            SubBlock block;
-            block.parse(input);
-            imageData.push_back(block);
-            if (block.size == 0) {
-                break;
-            }
-        }
-        endPosition = input.tellg();
+        imageData.parse(input);
+        endPosition = input.tell();
         return input;
     }
+
+    size_t decode(const uint8_t *bytes, uint8_t *out, size_t outSize) const {
+        LzwDecoder decoder;
+        return decoder.decode(lzwMinimumCodeSize, bytes, imageData, out,
+                              outSize);
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const TableBasedImageData &d) {
     os << "TableBasedImageData("
        << "position=[" << d.beginPosition << "," << d.endPosition << "], "
        << "lzwMinimumCodeSize=" << +d.lzwMinimumCodeSize << ","
-       << "ImageData=(size=" << d.imageData.size() << ")";
+       << "ImageData=(blocks=" << d.imageData.blockCount
+       << ", bytes=" << d.imageData.dataSize << ")";
 
     os << ")";
     return os;
@@ -245,8 +808,8 @@ struct ImageDescriptor {
     uint8_t sizeOfLocalColorTable;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&imageSeparator),
                    sizeof(imageSeparator));
         input.read(reinterpret_cast<char *>(&imageLeftPosition),
@@ -257,7 +820,7 @@ struct ImageDescriptor {
         input.read(reinterpret_cast<char *>(&imageHeight), sizeof(imageHeight));
         input.read(reinterpret_cast<char *>(&packedFields),
                    sizeof(packedFields));
-        endPosition = input.tellg();
+        endPosition = input.tell();
 
         parsepackedFields();
         return input;
@@ -268,7 +831,23 @@ struct ImageDescriptor {
         interlaceFlag = (packedFields & 0b0100'0000) >> 6;
         sortFlag = (packedFields & 0b0010'0000) >> 5;
         reserved = (packedFields & 0b001'1000) >> 3;
-        sizeOfLocalColorTable = (1 >> ((packedFields & 0b0000'0111))) - 1;
+        sizeOfLocalColorTable = (1 << ((packedFields & 0b0000'0111) + 1)) - 1;
+    }
+
+    // the inverse of parsepackedFields()
+    void packFields() {
+        packedFields = localColorTableFlag << 7 | interlaceFlag << 6 |
+                       sortFlag << 5 | (reserved & 0b11) << 3 |
+                       colorTableBits(sizeOfLocalColorTable + 1);
+    }
+
+    void write(std::string &out) const {
+        appendField(out, imageSeparator);
+        appendField(out, imageLeftPosition);
+        appendField(out, imageTopPosition);
+        appendField(out, imageWidth);
+        appendField(out, imageHeight);
+        appendField(out, packedFields);
     }
 };
 
@@ -306,17 +885,47 @@ struct TableBasedImage {
     TableBasedImageData imageData;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         imageDescriptor.parse(input);
         if (imageDescriptor.localColorTableFlag) {
             localColorTable.parse(input,
                                   imageDescriptor.sizeOfLocalColorTable + 1);
         }
         imageData.parse(input);
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
+
+    // Decodes the frame into `indices` (imageWidth * imageHeight, row order).
+    // The buffer is only grown, so reusing it across frames is free. `bytes`
+    // is the file the image was parsed from.
+    size_t decode(const uint8_t *bytes, std::vector<uint8_t> &indices) const {
+        size_t width = imageDescriptor.imageWidth;
+        size_t height = imageDescriptor.imageHeight;
+        size_t size = width * height;
+        if (indices.size() < size) {
+            indices.resize(size);
+        }
+        if (!imageDescriptor.interlaceFlag) {
+            return imageData.decode(bytes, indices.data(), size);
+        }
+
+        // interlaced rows arrive in four passes: 0/8, 4/8, 2/4, 1/2
+        std::vector<uint8_t> rows(size);
+        size_t decoded = imageData.decode(bytes, rows.data(), size);
+        static const size_t passStart[] = {0, 4, 2, 1};
+        static const size_t passStep[] = {8, 8, 4, 2};
+        size_t row = 0;
+        for (int pass = 0; pass < 4; ++pass) {
+            for (size_t y = passStart[pass]; y < height; y += passStep[pass]) {
+                std::copy_n(rows.data() + row * width, width,
+                            indices.data() + y * width);
+                ++row;
+            }
+        }
+        return decoded;
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const TableBasedImage &d) {
@@ -339,12 +948,10 @@ struct GraphicRenderingBlock {
     Type type = Type::Unknown;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
-        uint8_t extensionIntroducer = input.get();
-        uint8_t extensionLabel = input.get();
-        input.unget();
-        input.unget();
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
+        int extensionIntroducer = input.peek();
+        int extensionLabel = input.peek(1);
         if (extensionIntroducer == 0x21 && extensionLabel == 0x01) {
             type = Type::PlainTextExtension;
             plainTextExtension.parse(input);
@@ -352,7 +959,7 @@ struct GraphicRenderingBlock {
             type = Type::TableBasedImage;
             tableBasedImage.parse(input);
         }
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
 };
@@ -379,12 +986,12 @@ struct ApplicationExtension {
     uint8_t blockSize;
     uint8_t applicationIdentifier[8];
     uint8_t applAuthenticationCode[3];
-    std::vector<SubBlock> applicationData; // 15. Data Sub-blocks
+    SubBlockChain applicationData; // 15. Data Sub-blocks
 
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&extensionIntroducer),
                    sizeof(extensionIntroducer));
         input.read(reinterpret_cast<char *>(&extensionLabel),
@@ -394,15 +1001,8 @@ struct ApplicationExtension {
                    sizeof(applicationIdentifier));
         input.read(reinterpret_cast<char *>(&applAuthenticationCode),
                    sizeof(applAuthenticationCode));
-        while (true) {
-            SubBlock block;
-            block.parse(input);
-            applicationData.push_back(block);
-            if (block.size == 0) {
-                break;
-            }
-        }
-        endPosition = input.tellg();
+        applicationData.parse(input);
+        endPosition = input.tell();
         return input;
     }
 };
@@ -417,7 +1017,8 @@ std::ostream &operator<<(std::ostream &os, const ApplicationExtension &d) {
        << "  blockSize=" << +d.blockSize << ",\n"
        << "  applicationIdentifier=" << d.applicationIdentifier << ",\n"
        << "  applAuthenticationCode=" << d.applAuthenticationCode << ",\n"
-       << "  ApplicationData=(size=" << d.applicationData.size() << "),\n"
+       << "  ApplicationData=(blocks=" << d.applicationData.blockCount
+       << ", bytes=" << d.applicationData.dataSize << "),\n"
        << ")";
     return os;
 }
@@ -425,25 +1026,18 @@ std::ostream &operator<<(std::ostream &os, const ApplicationExtension &d) {
 struct CommentExtension {
     uint8_t extensionIntroducer;
     uint8_t commentLabel;
-    std::vector<SubBlock> commentData;
+    SubBlockChain commentData;
 
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&extensionIntroducer),
                    sizeof(extensionIntroducer));
         input.read(reinterpret_cast<char *>(&commentLabel),
                    sizeof(commentLabel));
-        while (true) {
-            SubBlock block;
-            block.parse(input);
-            commentData.push_back(block);
-            if (block.size == 0) {
-                break;
-            }
-        }
-        endPosition = input.tellg();
+        commentData.parse(input);
+        endPosition = input.tell();
         return input;
     }
 };
@@ -472,8 +1066,8 @@ struct GraphicControlExtension {
 
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&extensionIntroducer),
                    sizeof(extensionIntroducer));
         input.read(reinterpret_cast<char *>(&graphicControlLabel),
@@ -486,7 +1080,7 @@ struct GraphicControlExtension {
                    sizeof(transparentColorIndex));
         input.read(reinterpret_cast<char *>(&blockTerminator),
                    sizeof(blockTerminator));
-        endPosition = input.tellg();
+        endPosition = input.tell();
         parsepackedFields();
         return input;
     }
@@ -497,6 +1091,22 @@ struct GraphicControlExtension {
         userInputFlag = (packedFields & 0b0000'0010) >> 1;
         transparentColorFlag = (packedFields & 0b0000'0001);
     }
+
+    // the inverse of parsepackedFields()
+    void packFields() {
+        packedFields = (reserved & 0b111) << 5 | (disposalMethod & 0b111) << 2 |
+                       userInputFlag << 1 | transparentColorFlag;
+    }
+
+    void write(std::string &out) const {
+        appendField(out, extensionIntroducer);
+        appendField(out, graphicControlLabel);
+        appendField(out, blockSize);
+        appendField(out, packedFields);
+        appendField(out, delayTime);
+        appendField(out, transparentColorIndex);
+        appendField(out, blockTerminator);
+    }
 };
 
 std::ostream &operator<<(std::ostream &os, const GraphicControlExtension &d) {
@@ -528,11 +1138,11 @@ struct GraphicBlock {
 
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         graphicControlExtension.parse(input);
         graphicRenderingBlock.parse(input);
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
 };
@@ -552,10 +1162,10 @@ struct Trailer {
     char trailer;
     int beginPosition;
     int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    ByteCursor &parse(ByteCursor &input) {
+        beginPosition = static_cast<int>(input.tell()) + 1;
         input.read(reinterpret_cast<char *>(&trailer), sizeof(trailer));
-        endPosition = input.tellg();
+        endPosition = input.tell();
         return input;
     }
 };
@@ -574,93 +1184,3095 @@ struct Trailer {
 // <Special-Purpose Block> ::=    Application Extension  |
 //                                Comment Extension
 
-struct GifDataStream {
+// One frame of the frame index: where it is in the file, how it is drawn,
+// and which frame a decode has to start from to reproduce it.
+struct FrameIndexEntry {
+    uint64_t offset;      // Graphic Control Extension, or the image itself
+    uint64_t imageOffset; // Image Descriptor
+    uint32_t keyframe;    // decoding keyframe..this frame from a cleared
+                          // canvas gives the same picture as frames 0..this
+    uint16_t delayTime;
+    uint16_t left;
+    uint16_t top;
+    uint16_t width;
+    uint16_t height;
+    uint8_t disposalMethod;
+    bool transparentColorFlag;
+    uint8_t transparentColorIndex;
+};
+
+std::ostream &operator<<(std::ostream &os, const FrameIndexEntry &d) {
+    os << "FrameIndexEntry("
+       << "offset=" << d.offset << ", imageOffset=" << d.imageOffset
+       << ", keyframe=" << d.keyframe << ", delayTime=" << d.delayTime
+       << ", rect=[" << d.left << "," << d.top << "," << d.width << ","
+       << d.height << "]"
+       << ", disposalMethod=" << +d.disposalMethod
+       << ", transparentColorFlag=" << d.transparentColorFlag
+       << ", transparentColorIndex=" << +d.transparentColorIndex << ")";
+    return os;
+}
+
+// Receives the structures of a GIF as a parser walks it. Override the
+// callbacks you need and keep only their bits in `interests`: structures
+// nobody asked for are hopped over without being parsed. Views inside the
+// structures point into `bytes`, which is only valid during the call.
+struct GifVisitor {
+    enum Interest : unsigned {
+        ApplicationExtensions = 1 << 0,
+        CommentExtensions = 1 << 1,
+        GraphicControlExtensions = 1 << 2,
+        FrameEntries = 1 << 3, // onFrameEntry: placement only, no image parse
+        Frames = 1 << 4,       // onFrame: the parsed Table-Based Image
+        All = ~0u,
+    };
+    unsigned interests = All;
+    bool stop = false; // set from a callback to end the walk there
+
+    virtual ~GifVisitor() = default;
+    virtual void onScreen(const Header &, const LogicScreen &) {}
+    virtual void onApplicationExtension(const ApplicationExtension &,
+                                        const uint8_t * /* bytes */) {}
+    virtual void onCommentExtension(const CommentExtension &,
+                                    const uint8_t * /* bytes */) {}
+    virtual void onGraphicControlExtension(const GraphicControlExtension &) {}
+    virtual void onFrameEntry(size_t /* n */, const FrameIndexEntry &) {}
+    virtual void onFrame(size_t /* n */, const FrameIndexEntry &,
+                         const TableBasedImage &, const uint8_t * /* bytes */) {
+    }
+    virtual void onTrailer() {}
+    // the stream ended, or stopped making sense, at `offset`
+    virtual void onError(uint64_t /* offset */, int /* found */) {}
+};
+
+// Fills the drawing parameters of a FrameIndexEntry from a Graphic Control
+// Extension.
+void applyControl(FrameIndexEntry &entry,
+                  const GraphicControlExtension &control) {
+    entry.delayTime = control.delayTime;
+    entry.disposalMethod = control.disposalMethod;
+    entry.transparentColorFlag = control.transparentColorFlag;
+    entry.transparentColorIndex = control.transparentColorIndex;
+}
+
+// --stats keys blocks by their introducer and label bytes; 'G' stands for
+// the header and logical screen.
+void nameBlock(StructureScope &scope, int introducer, int label = 0) {
+    if (!scope.active()) {
+        return;
+    }
+    scope.key = introducer == 0x21 ? 0x2100 | (label & 0xFF) : introducer;
+    switch (scope.key) {
+    case 'G':
+        scope.name = "header";
+        break;
+    case 0x21F9:
+        scope.name = "graphic control extension";
+        break;
+    case 0x21FF:
+        scope.name = "application extension";
+        break;
+    case 0x21FE:
+        scope.name = "comment extension";
+        break;
+    case 0x2101:
+        scope.name = "plain text extension";
+        break;
+    case 0x2C:
+        scope.name = "image";
+        break;
+    case 0x3B:
+        scope.name = "trailer";
+        break;
+    default:
+        scope.name = "unknown extension";
+    }
+}
+
+// Pull parser: walks a GIF held in memory and reports its structures to
+// `visitor`. Returns false if the header and logical screen are unreadable.
+bool walkGif(ByteCursor &input, GifVisitor &visitor) {
+    const uint8_t *bytes = input.data;
+    const unsigned interests = visitor.interests;
     Header header;
     LogicScreen logicScreen;
-    ApplicationExtension applicationExtension;
-    std::vector<GraphicBlock> graphicBlocks;
-    std::vector<CommentExtension> commentExtensions;
-    Trailer trailer;
+    {
+        StructureScope scope(input.pos);
+        nameBlock(scope, 'G');
+        header.parse(input);
+        logicScreen.parse(input);
+    }
+    if (!input) {
+        visitor.onError(input.tell(), -1);
+        return false;
+    }
+    visitor.onScreen(header, logicScreen);
 
-    int beginPosition;
-    int endPosition;
-    std::istream &parse(std::istream &input) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
-        if (header.parse(input)) {
-            std::cout << header << std::endl;
-        }
-
-        if (logicScreen.parse(input)) {
-            std::cout << logicScreen << std::endl;
-        }
-
-        while (input.peek() == 0x21) {
-            // uint8_t extensionIntroducer =
-            input.get();
-            uint8_t extensionLabel = input.get();
-            input.unget();
-            input.unget();
-            if (extensionLabel == 0xFF) {
-                applicationExtension.parse(input);
-                std::cout << applicationExtension << std::endl;
-            } else if (extensionLabel == 0xFE) {
-                CommentExtension commentExtension;
-                commentExtension.parse(input);
-                std::cout << commentExtension << std::endl;
-                commentExtensions.push_back(commentExtension);
-            } else if (extensionLabel == 0xF9) { // Graphic Control Extension
-                // <Graphic Block> ::=
-                //   [Graphic Control Extension] <Graphic-Rendering Block>
-                GraphicBlock graphicBlock;
-                graphicBlock.parse(input);
-                graphicBlocks.push_back(graphicBlock);
-                std::cout << graphicBlock << std::endl;
+    FrameIndexEntry control = {};
+    bool hasControl = false;
+    size_t frames = 0;
+    while (input && !visitor.stop) {
+        size_t offset = input.tell();
+        StructureScope scope(input.pos);
+        int introducer = input.peek();
+        if (introducer == 0x21) {
+            int label = input.peek(1);
+            nameBlock(scope, introducer, label);
+            if (label == 0xF9) {
+                GraphicControlExtension extension;
+                extension.parse(input);
+                control = {};
+                control.offset = offset;
+                applyControl(control, extension);
+                hasControl = true;
+                if (interests & GifVisitor::GraphicControlExtensions) {
+                    visitor.onGraphicControlExtension(extension);
+                }
+                continue;
+            }
+            if (label == 0xFF &&
+                (interests & GifVisitor::ApplicationExtensions)) {
+                ApplicationExtension extension;
+                extension.parse(input);
+                visitor.onApplicationExtension(extension, bytes);
+                continue;
+            }
+            if (label == 0xFE && (interests & GifVisitor::CommentExtensions)) {
+                CommentExtension extension;
+                extension.parse(input);
+                visitor.onCommentExtension(extension, bytes);
+                continue;
+            }
+            if (label == 0x01) { // plain text uses up the control block
+                hasControl = false;
+            }
+            input.skip(2);
+            SubBlockChain chain;
+            chain.parse(input);
+        } else if (introducer == 0x2C) {
+            nameBlock(scope, introducer);
+            FrameIndexEntry entry = hasControl ? control : FrameIndexEntry{};
+            if (!hasControl) {
+                entry.offset = offset;
+            }
+            entry.imageOffset = offset;
+            hasControl = false;
+            if (interests & GifVisitor::Frames) {
+                TableBasedImage image;
+                image.parse(input);
+                if (!input) {
+                    break; // truncated frame
+                }
+                entry.left = image.imageDescriptor.imageLeftPosition;
+                entry.top = image.imageDescriptor.imageTopPosition;
+                entry.width = image.imageDescriptor.imageWidth;
+                entry.height = image.imageDescriptor.imageHeight;
+                if (interests & GifVisitor::FrameEntries) {
+                    visitor.onFrameEntry(frames, entry);
+                }
+                visitor.onFrame(frames, entry, image, bytes);
             } else {
-                break;
+                ImageDescriptor descriptor;
+                descriptor.parse(input);
+                if (descriptor.localColorTableFlag) {
+                    input.skip(3 * (descriptor.sizeOfLocalColorTable + 1));
+                }
+                input.skip(1); // LZW Minimum Code Size
+                SubBlockChain chain;
+                chain.parse(input);
+                if (!input) {
+                    break; // truncated frame
+                }
+                entry.left = descriptor.imageLeftPosition;
+                entry.top = descriptor.imageTopPosition;
+                entry.width = descriptor.imageWidth;
+                entry.height = descriptor.imageHeight;
+                if (interests & GifVisitor::FrameEntries) {
+                    visitor.onFrameEntry(frames, entry);
+                }
             }
-        }
-
-        if (input.peek() == 0x3B) {
+            ++frames;
+        } else if (introducer == 0x3B) {
+            nameBlock(scope, introducer);
+            Trailer trailer;
             trailer.parse(input);
-            endPosition = input.tellg();
+            visitor.onTrailer();
+            return true;
         } else {
-            std::cout << "Error"                   //
-                      << std::hex << std::showbase //
-                      << +input.peek()             //
-                      << std::resetiosflags(std::ios::hex |
-                                            std::ios::showbase) //
-                      << std::endl;                             //
+            break;
         }
+    }
+    if (!visitor.stop) {
+        visitor.onError(input.tell(), input.peek());
+    }
+    return true;
+}
+
+// Reassembles the <Graphic Block> a visitor saw as separate events.
+GraphicBlock makeGraphicBlock(const GraphicControlExtension &control,
+                              const FrameIndexEntry &entry,
+                              const TableBasedImage &image) {
+    GraphicBlock block;
+    block.graphicControlExtension = control;
+    block.graphicRenderingBlock.type =
+        GraphicRenderingBlock::Type::TableBasedImage;
+    block.graphicRenderingBlock.tableBasedImage = image;
+    block.graphicRenderingBlock.beginPosition = image.beginPosition;
+    block.graphicRenderingBlock.endPosition = image.endPosition;
+    block.beginPosition = static_cast<int>(entry.offset) + 1;
+    block.endPosition = image.endPosition;
+    return block;
+}
+
+// The whole GIF as a tree, for callers that want to keep every structure.
+// The blocks live in the stream's arena: a deque never moves the ones
+// already parsed as it grows, and the tree is freed in one step with it.
+struct GifDataStream : GifVisitor {
+    Arena arena;
+    Header header;
+    LogicScreen logicScreen;
+    ApplicationExtension applicationExtension;
+    std::pmr::deque<GraphicBlock> graphicBlocks{&arena};
+    std::pmr::vector<CommentExtension> commentExtensions{&arena};
+    Trailer trailer;
+    const uint8_t *bytes = nullptr; // the file the views point into
+    GraphicControlExtension control = {};
 
+    int beginPosition;
+    int endPosition;
+    ByteCursor &parse(ByteCursor &input) {
+        bytes = input.data;
+        beginPosition = static_cast<int>(input.tell()) + 1;
+        walkGif(input, *this);
+        endPosition = input.tell();
         return input;
     }
+
+    void onScreen(const Header &h, const LogicScreen &screen) override {
+        header = h;
+        logicScreen = screen;
+    }
+
+    void onApplicationExtension(const ApplicationExtension &extension,
+                                const uint8_t *) override {
+        applicationExtension = extension;
+    }
+
+    void onCommentExtension(const CommentExtension &extension,
+                            const uint8_t *) override {
+        commentExtensions.push_back(extension);
+    }
+
+    void onGraphicControlExtension(
+        const GraphicControlExtension &extension) override {
+        control = extension;
+    }
+
+    void onFrame(size_t, const FrameIndexEntry &entry,
+                 const TableBasedImage &image, const uint8_t *) override {
+        graphicBlocks.push_back(makeGraphicBlock(control, entry, image));
+        control = {};
+    }
 };
 
-int main(int argc, char *argv[]) {
+// Prints every structure, the way gif_parser always has.
+struct GifPrinter : GifVisitor {
+    std::ostream &os;
+    GraphicControlExtension control = {};
+    size_t frames = 0;
 
-    if (argc <= 1) {
-        std::cout << "Usage: gif_parser <gif file>" << std::endl;
-        return 0;
+    explicit GifPrinter(std::ostream &os) : os(os) {}
+
+    void onScreen(const Header &header, const LogicScreen &screen) override {
+        os << header << std::endl;
+        os << screen << std::endl;
     }
 
-    std::string file(argv[1]);
+    void onApplicationExtension(const ApplicationExtension &extension,
+                                const uint8_t *) override {
+        os << extension << std::endl;
+    }
 
-    std::ifstream input(file, std::ios::binary);
+    void onCommentExtension(const CommentExtension &extension,
+                            const uint8_t *) override {
+        os << extension << std::endl;
+    }
 
-    if (!input) {
-        std::cout << "file is not exists: " << file << std::endl;
-        return -1;
+    void onGraphicControlExtension(
+        const GraphicControlExtension &extension) override {
+        control = extension;
     }
 
-    if (input.peek() != 'G') {
-        std::cout << "it is not a gif file: " << file << std::endl;
-        return -1;
+    void onFrame(size_t, const FrameIndexEntry &entry,
+                 const TableBasedImage &image, const uint8_t *) override {
+        os << makeGraphicBlock(control, entry, image) << std::endl;
+        control = {};
+        ++frames;
     }
 
-    GifDataStream gif;
-    gif.parse(input);
+    void onError(uint64_t, int found) override {
+        os << "Error"                                             //
+           << std::hex << std::showbase                           //
+           << found                                               //
+           << std::resetiosflags(std::ios::hex | std::ios::showbase) //
+           << std::endl;                                          //
+    }
+};
+
+struct Rect {
+    size_t left = 0;
+    size_t top = 0;
+    size_t width = 0;
+    size_t height = 0;
+
+    bool empty() const { return width == 0 || height == 0; }
+    size_t area() const { return width * height; }
+
+    // bounding box of both
+    Rect merge(const Rect &o) const {
+        if (empty()) {
+            return o;
+        }
+        if (o.empty()) {
+            return *this;
+        }
+        size_t l = std::min(left, o.left);
+        size_t t = std::min(top, o.top);
+        size_t r = std::max(left + width, o.left + o.width);
+        size_t b = std::max(top + height, o.top + o.height);
+        return {l, t, r - l, b - t};
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const Rect &d) {
+    os << "[" << d.left << "," << d.top << "," << d.width << "," << d.height
+       << "]";
+    return os;
+}
+
+// Draws frames onto a logical-screen sized RGBA canvas, applying the
+// previous frame's disposal method before each frame is drawn. Work is
+// limited to the frame's rectangle: "restore to previous" saves and restores
+// just that region, and `dirty` reports the part of the canvas that changed
+// with the last draw().
+struct Compositor {
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint32_t> canvas;
+    std::vector<uint32_t> saved; // region under a "restore to previous" frame
+    Rect lastRect;               // clipped rectangle of the last frame
+    uint8_t lastDisposal = 0;
+    bool hasLast = false;
+    Rect dirty;
+    const PaletteKernels &kernels = PaletteKernels::best();
+
+    void reset(size_t w, size_t h) {
+        width = w;
+        height = h;
+        canvas.assign(w * h, 0);
+        hasLast = false;
+        dirty = {0, 0, w, h}; // everything is new to whoever reads the canvas
+    }
+
+    Rect clip(const FrameIndexEntry &frame) const {
+        if (frame.left >= width || frame.top >= height) {
+            return {};
+        }
+        return {frame.left, frame.top,
+                std::min<size_t>(frame.width, width - frame.left),
+                std::min<size_t>(frame.height, height - frame.top)};
+    }
+
+    // returns the region the disposal changed
+    Rect dispose() {
+        if (!hasLast) {
+            return {};
+        }
+        hasLast = false;
+        const Rect &r = lastRect;
+        if (lastDisposal == 2) { // restore to background
+            for (size_t y = r.top; y < r.top + r.height; ++y) {
+                uint32_t *row = canvas.data() + y * width + r.left;
+                std::fill(row, row + r.width, 0);
+            }
+            return r;
+        }
+        if (lastDisposal == 3) { // restore to previous
+            for (size_t y = 0; y < r.height; ++y) {
+                std::copy_n(saved.data() + y * r.width, r.width,
+                            canvas.data() + (r.top + y) * width + r.left);
+            }
+            return r;
+        }
+        return {};
+    }
+
+    void draw(const FrameIndexEntry &frame, const uint8_t *indices,
+              const uint32_t palette[256]) {
+        bool fresh = !hasLast;
+        Rect disposed = dispose();
+        Rect r = clip(frame);
+        if (frame.disposalMethod == 3) {
+            saved.resize(r.area());
+            for (size_t y = 0; y < r.height; ++y) {
+                std::copy_n(canvas.data() + (r.top + y) * width + r.left,
+                            r.width, saved.data() + y * r.width);
+            }
+        }
+        for (size_t y = 0; y < r.height; ++y) {
+            const uint8_t *src = indices + y * frame.width;
+            uint32_t *dst = canvas.data() + (r.top + y) * width + r.left;
+            if (frame.transparentColorFlag) {
+                kernels.composite(src, r.width, palette,
+                                  frame.transparentColorIndex, dst);
+            } else {
+                kernels.expand(src, r.width, palette, dst);
+            }
+        }
+        // after reset() the whole canvas is dirty until the first frame
+        dirty = fresh ? dirty.merge(disposed).merge(r) : disposed.merge(r);
+        lastRect = r;
+        lastDisposal = frame.disposalMethod;
+        hasLast = true;
+    }
+};
+
+// Random access to the frames of a GIF. build() pre-scans the file, only
+// hopping over sub-block length bytes, and records every frame's offset,
+// drawing parameters and keyframe. seekFrame(n) then decodes from frame n's
+// keyframe (or from the current frame, when that is closer) instead of
+// from the start of the file. `frames` views either the entries build()
+// collected or a mapped GifIndexCache.
+struct GifFrameIndex {
+    LogicScreen logicScreen;
+    std::span<const FrameIndexEntry> frames;
+    std::vector<FrameIndexEntry> storage;
+    std::shared_ptr<const void> mapping; // the cache `frames` points into
+    const uint8_t *bytes = nullptr;
+    size_t size = 0;
+
+    PixelFormat format = PixelFormat::RGBA;
+    Compositor compositor;
+    std::vector<uint8_t> indices;
+    size_t current = SIZE_MAX; // frame the canvas holds
+    size_t replayStart = 0;    // frame the canvas was last rebuilt from
+
+    GifFrameIndex() = default;
+    GifFrameIndex(const GifFrameIndex &) = delete; // `frames` is a view
+
+    bool build(const uint8_t *data, size_t length) {
+        bytes = data;
+        size = length;
+        storage.clear();
+        frames = {};
+        mapping.reset();
+        current = SIZE_MAX;
+
+        struct Collector : GifVisitor {
+            GifFrameIndex &index;
+            explicit Collector(GifFrameIndex &index) : index(index) {
+                interests = FrameEntries;
+            }
+            void onScreen(const Header &, const LogicScreen &screen) override {
+                index.logicScreen = screen;
+            }
+            void onFrameEntry(size_t, const FrameIndexEntry &entry) override {
+                index.storage.push_back(entry);
+            }
+        } collector(*this);
+
+        ByteCursor input(data, length);
+        if (!walkGif(input, collector)) {
+            return false;
+        }
+
+        computeKeyframes();
+        frames = storage;
+        return true;
+    }
+
+    // A frame that covers the whole screen without transparency does not
+    // depend on the canvas. Otherwise it depends on the canvas left by the
+    // previous frame's disposal, which is tracked as `before`: the frame a
+    // decode must start from to rebuild the canvas a frame is drawn on.
+    void computeKeyframes() {
+        const auto &screen = logicScreen.logicalScreenDescriptor;
+        uint32_t before = 0;
+        for (uint32_t i = 0; i < storage.size(); ++i) {
+            FrameIndexEntry &f = storage[i];
+            bool full = f.left == 0 && f.top == 0 &&
+                        f.width >= screen.logicalScreenWidth &&
+                        f.height >= screen.logicalScreenHeight;
+            f.keyframe = full && !f.transparentColorFlag ? i : before;
+            if (f.disposalMethod == 2) {
+                before = full ? i + 1 : f.keyframe;
+            } else if (f.disposalMethod != 3) {
+                before = f.keyframe;
+            }
+        }
+    }
+
+    // Returns the canvas with frame n composited, or nullptr when there is
+    // no frame n.
+    const std::vector<uint32_t> *seekFrame(size_t n) {
+        if (n >= frames.size()) {
+            return nullptr;
+        }
+        // The canvas can be carried forward only if it was rebuilt from a
+        // frame at or before n's keyframe; a later rebuild may have skipped
+        // state that frame n still depends on.
+        size_t start = frames[n].keyframe;
+        if (current != SIZE_MAX && replayStart <= start &&
+            current + 1 >= start && current <= n) {
+            start = current + 1;
+        } else {
+            const auto &screen = logicScreen.logicalScreenDescriptor;
+            compositor.reset(screen.logicalScreenWidth,
+                             screen.logicalScreenHeight);
+            replayStart = start;
+        }
+        for (size_t i = start; i <= n; ++i) {
+            drawFrame(i);
+        }
+        current = n;
+        return &compositor.canvas;
+    }
+
+    void drawFrame(size_t i) {
+        uint32_t palette[256];
+        decodeFrame(i, indices, palette);
+        compositor.draw(frames[i], indices.data(), palette);
+    }
+
+    // Decodes frame i's indices and palette; safe to call from any thread.
+    void decodeFrame(size_t i, std::vector<uint8_t> &out,
+                     uint32_t palette[256]) const {
+        ByteCursor input(bytes, size);
+        input.skip(frames[i].imageOffset);
+        if (statsEnabled()) {
+            ++parseStats().seeks;
+        }
+        TableBasedImage image;
+        image.parse(input);
+        image.decode(bytes, out);
+        const ColorTable &table = image.imageDescriptor.localColorTableFlag
+                                      ? image.localColorTable
+                                      : logicScreen.globalColorTabel;
+        std::copy_n(table.lut(format), 256, palette);
+    }
+};
+
+// On-disk image of a GifFrameIndex, kept next to the GIF as "<gif>.idx":
+// a header naming the source it was built from, then the frame entries
+// exactly as they sit in memory. A warm open maps the file, checks the
+// header against the source and points the index's `frames` into the
+// mapping; there is nothing to deserialize. A cache from another source,
+// version or build layout is ignored and rewritten.
+//
+// The source key only samples the file, so a cache is not trusted beyond
+// it: each entry is checked against the Image Descriptor it points at,
+// and the logical screen is parsed again from the source, which costs a
+// few hundred bytes.
+struct GifIndexCache {
+    static constexpr char magic[8] = {'G', 'I', 'F', 'I', 'D', 'X', 0, 1};
+    static constexpr uint32_t version = 2;
+    static constexpr size_t alignment = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entrySize; // sizeof(FrameIndexEntry)
+        uint32_t pathLength;
+        SourceKey source;
+        uint64_t frameCount;
+        uint64_t framesOffset;
+    };
+    static_assert(std::is_trivially_copyable_v<FrameIndexEntry> &&
+                  std::is_standard_layout_v<FrameIndexEntry>);
+
+    static std::string pathFor(const std::string &gif) { return gif + ".idx"; }
+
+    static uint64_t align(uint64_t n) {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    // fills `index` from the cache of `gif`, whose contents are `data`
+    static bool load(const std::string &gif, const uint8_t *data,
+                     size_t length, GifFrameIndex &index) {
+        SourceKey source;
+        if (!source.read(gif)) {
+            return false;
+        }
+        int fd = ::open(pathFor(gif).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        size_t mapSize = st.st_size;
+        std::shared_ptr<const void> mapping(
+            map, [mapSize](const void *p) {
+                munmap(const_cast<void *>(p), mapSize);
+            });
+
+        const auto *header = static_cast<const Header *>(map);
+        const char *base = static_cast<const char *>(map);
+        if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+            header->version != version ||
+            header->entrySize != sizeof(FrameIndexEntry) ||
+            !(header->source == source) ||
+            header->pathLength != gif.size() ||
+            sizeof(Header) + header->pathLength > mapSize ||
+            std::memcmp(base + sizeof(Header), gif.data(), gif.size()) != 0 ||
+            header->framesOffset > mapSize ||
+            header->framesOffset % alignof(FrameIndexEntry) != 0 ||
+            header->frameCount >
+                (mapSize - header->framesOffset) / sizeof(FrameIndexEntry)) {
+            return false;
+        }
+        std::span<const FrameIndexEntry> frames = {
+            reinterpret_cast<const FrameIndexEntry *>(base +
+                                                      header->framesOffset),
+            header->frameCount};
+        LogicScreen logicScreen;
+        if (!parseScreen(data, length, logicScreen) ||
+            !validFrames(frames, data, length)) {
+            return false;
+        }
+
+        index.logicScreen = logicScreen;
+        index.storage.clear();
+        index.frames = frames;
+        index.mapping = std::move(mapping);
+        index.bytes = data;
+        index.size = length;
+        index.current = SIZE_MAX;
+        return true;
+    }
+
+    static bool parseScreen(const uint8_t *data, size_t length,
+                            LogicScreen &logicScreen) {
+        ByteCursor input(data, length);
+        ::Header gifHeader; // Header alone is the cache's
+        gifHeader.parse(input);
+        logicScreen.parse(input);
+        return static_cast<bool>(input);
+    }
+
+    // Each entry must be the frame the source has at its offsets: the
+    // decoders size a frame's indices from the Image Descriptor but draw it
+    // with the entry's rect, and replay from its keyframe.
+    static bool validFrames(std::span<const FrameIndexEntry> frames,
+                            const uint8_t *data, size_t length) {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            const FrameIndexEntry &f = frames[i];
+            uint8_t flag; // not read as a bool until it is known to be one
+            std::memcpy(&flag,
+                        reinterpret_cast<const char *>(&f) +
+                            offsetof(FrameIndexEntry, transparentColorFlag),
+                        sizeof(flag));
+            if (f.offset > f.imageOffset || f.imageOffset >= length ||
+                f.keyframe > i || f.disposalMethod > 7 || flag > 1) {
+                return false;
+            }
+            ByteCursor input(data, length);
+            input.skip(f.imageOffset);
+            ImageDescriptor descriptor;
+            descriptor.parse(input);
+            if (!input || descriptor.imageSeparator != 0x2C ||
+                descriptor.imageLeftPosition != f.left ||
+                descriptor.imageTopPosition != f.top ||
+                descriptor.imageWidth != f.width ||
+                descriptor.imageHeight != f.height) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // writes the cache through a temporary file, so readers never see half
+    // of one; returns false if the directory is not writable
+    static bool save(const std::string &gif, const GifFrameIndex &index) {
+        Header header = {};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.entrySize = sizeof(FrameIndexEntry);
+        header.pathLength = gif.size();
+        if (!header.source.read(gif)) {
+            return false;
+        }
+        header.frameCount = index.frames.size();
+        header.framesOffset = align(sizeof(Header) + gif.size());
+
+        std::string image(header.framesOffset +
+                              index.frames.size_bytes(),
+                          '\0');
+        std::memcpy(&image[0], &header, sizeof(header));
+        std::memcpy(&image[sizeof(Header)], gif.data(), gif.size());
+        if (!index.frames.empty()) {
+            std::memcpy(&image[header.framesOffset], index.frames.data(),
+                        index.frames.size_bytes());
+        }
+
+        std::string temporary =
+            pathFor(gif) + ".tmp" + std::to_string(getpid());
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = ::write(fd, image.data(), image.size()) ==
+                  static_cast<ssize_t>(image.size());
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), pathFor(gif).c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Decodes frames on a pool of worker threads and composites them in order on
+// the calling thread. LZW streams are independent, so workers take frames in
+// any order; they run at most `depth` frames ahead of the compositor, which
+// bounds memory to `depth` index buffers and keeps output in frame order.
+struct ParallelDecoder {
+    struct Slot {
+        std::vector<uint8_t> indices;
+        uint32_t palette[256];
+        bool ready = false;
+    };
+
+    size_t threads;
+    size_t depth;
+
+    // threads == 0 uses every core
+    explicit ParallelDecoder(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        this->threads = threads;
+        depth = threads * 2;
+    }
+
+    // calls onFrame(size_t frame, const Compositor &) for every frame, in
+    // order, with the frame composited onto the canvas
+    template <typename F>
+    void run(const GifFrameIndex &index, Compositor &compositor, F onFrame) {
+        const size_t count = index.frames.size();
+        std::vector<Slot> slots(depth);
+        std::mutex mutex;
+        std::condition_variable decoded;
+        std::condition_variable freed;
+        size_t next = 0;       // next frame handed to a worker
+        size_t composited = 0; // frames the compositor is done with
+
+        auto worker = [&] {
+            while (true) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    freed.wait(lock, [&] {
+                        return next >= count || next < composited + depth;
+                    });
+                    if (next >= count) {
+                        return;
+                    }
+                    i = next++;
+                }
+                Slot &slot = slots[i % depth];
+                index.decodeFrame(i, slot.indices, slot.palette);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.ready = true;
+                }
+                decoded.notify_one();
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t t = 0; t < std::min(threads, count); ++t) {
+            pool.emplace_back(worker);
+        }
+
+        const auto &screen = index.logicScreen.logicalScreenDescriptor;
+        compositor.reset(screen.logicalScreenWidth, screen.logicalScreenHeight);
+        for (size_t i = 0; i < count; ++i) {
+            Slot &slot = slots[i % depth];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                decoded.wait(lock, [&] { return slot.ready; });
+            }
+            compositor.draw(index.frames[i], slot.indices.data(),
+                            slot.palette);
+            onFrame(i, static_cast<const Compositor &>(compositor));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.ready = false;
+                ++composited;
+            }
+            freed.notify_all();
+        }
+
+        for (auto &thread : pool) {
+            thread.join();
+        }
+    }
+};
+
+// Push-style GIF parser: feed() takes chunks of any size, as they arrive.
+// A small state machine follows the block structure byte by byte, stopping
+// anywhere (inside a sub-block too) when a chunk runs out. The bytes of the
+// structure in progress are kept verbatim, and once it is complete they are
+// parsed by the regular structs and handed to the visitor, so a frame can
+// be decoded while the rest of the file is still on its way. Sub-block data
+// of structures the visitor has no interest in is counted, not kept.
+struct GifPushParser {
+    enum class State {
+        Screen,           // Header and Logical Screen Descriptor
+        GlobalColorTable, //
+        Introducer,       // 0x21, 0x2C or 0x3B
+        ExtensionLabel,   //
+        ImageDescriptor,  // the 9 bytes after the Image Separator
+        LocalColorTable,  //
+        LzwCodeSize,      //
+        SubBlockSize,     //
+        SubBlockData,     //
+        Done,             //
+        Error,            //
+    };
+
+    GifVisitor &visitor;
+    State state = State::Screen;
+    size_t need = 13; // bytes the current state still waits for
+    std::vector<uint8_t> pending;
+    bool keep = true; // buffer the sub-block data of the current structure
+    uint64_t consumed = 0; // bytes fed so far
+    uint64_t blockOffset = 0;
+
+    LogicScreen logicScreen;
+    FrameIndexEntry control = {};
+    bool hasControl = false;
+    size_t frameCount = 0;
+
+    explicit GifPushParser(GifVisitor &visitor) : visitor(visitor) {}
+
+    bool done() const { return state == State::Done; }
+    bool failed() const { return state == State::Error; }
+
+    // returns false once the stream turned out not to be a valid GIF
+    bool feed(const uint8_t *data, size_t size) {
+        while (size > 0 && state != State::Done && state != State::Error) {
+            size_t take = std::min(need, size);
+            if (keep || state != State::SubBlockData) {
+                pending.insert(pending.end(), data, data + take);
+            }
+            data += take;
+            size -= take;
+            consumed += take;
+            need -= take;
+            if (need == 0) {
+                advance();
+                if (visitor.stop) {
+                    state = State::Done;
+                }
+            }
+        }
+        return state != State::Error;
+    }
+
+    void expect(State next, size_t bytes) {
+        state = next;
+        need = bytes;
+    }
+
+    void advance() {
+        switch (state) {
+        case State::Screen:
+            if (pending[0] != 'G' || pending[1] != 'I' || pending[2] != 'F') {
+                state = State::Error;
+                visitor.onError(0, pending[0]);
+            } else if (pending[10] & 0b1000'0000) {
+                expect(State::GlobalColorTable, 3 << ((pending[10] & 7) + 1));
+            } else {
+                finishScreen();
+            }
+            break;
+        case State::GlobalColorTable:
+            finishScreen();
+            break;
+        case State::Introducer:
+            blockOffset = consumed - 1;
+            if (pending.back() == 0x21) {
+                expect(State::ExtensionLabel, 1);
+            } else if (pending.back() == 0x2C) {
+                keep = visitor.interests & GifVisitor::Frames;
+                expect(State::ImageDescriptor, 9);
+            } else if (pending.back() == 0x3B) {
+                StructureScope scope;
+                nameBlock(scope, 0x3B);
+                scope.bytes = 1;
+                state = State::Done;
+                visitor.onTrailer();
+            } else {
+                state = State::Error;
+                visitor.onError(blockOffset, pending.back());
+            }
+            break;
+        case State::ExtensionLabel:
+            switch (pending.back()) {
+            case 0xF9: // always kept: frames need it
+                keep = true;
+                break;
+            case 0xFF:
+                keep = visitor.interests & GifVisitor::ApplicationExtensions;
+                break;
+            case 0xFE:
+                keep = visitor.interests & GifVisitor::CommentExtensions;
+                break;
+            default:
+                keep = false;
+            }
+            expect(State::SubBlockSize, 1);
+            break;
+        case State::ImageDescriptor:
+            if (pending[9] & 0b1000'0000) {
+                expect(State::LocalColorTable, 3 << ((pending[9] & 7) + 1));
+            } else {
+                expect(State::LzwCodeSize, 1);
+            }
+            break;
+        case State::LocalColorTable:
+            expect(State::LzwCodeSize, 1);
+            break;
+        case State::LzwCodeSize:
+            expect(State::SubBlockSize, 1);
+            break;
+        case State::SubBlockSize:
+            if (pending.back() == 0) {
+                finishBlock();
+            } else {
+                expect(State::SubBlockData, pending.back());
+            }
+            break;
+        case State::SubBlockData:
+            expect(State::SubBlockSize, 1);
+            break;
+        case State::Done:
+        case State::Error:
+            break;
+        }
+    }
+
+    void finishScreen() {
+        StructureScope scope;
+        nameBlock(scope, 'G');
+        scope.bytes = pending.size();
+        ByteCursor input(pending.data(), pending.size());
+        Header header;
+        header.parse(input);
+        logicScreen.parse(input);
+        visitor.onScreen(header, logicScreen);
+        pending.clear();
+        expect(State::Introducer, 1);
+    }
+
+    // A whole extension or image is in `pending`. --stats times only the
+    // parse here, not the feeding that assembled it.
+    void finishBlock() {
+        StructureScope scope;
+        nameBlock(scope, pending[0], pending[0] == 0x21 ? pending[1] : 0);
+        scope.bytes = consumed - blockOffset;
+        ByteCursor input(pending.data(), pending.size());
+        const unsigned interests = visitor.interests;
+        if (pending[0] == 0x2C) {
+            FrameIndexEntry entry = hasControl ? control : FrameIndexEntry{};
+            if (!hasControl) {
+                entry.offset = blockOffset;
+            }
+            entry.imageOffset = blockOffset;
+            hasControl = false;
+            // the descriptor is always kept, the image data only if wanted
+            TableBasedImage image;
+            if (keep) {
+                image.parse(input);
+            } else {
+                image.imageDescriptor.parse(input);
+            }
+            entry.left = image.imageDescriptor.imageLeftPosition;
+            entry.top = image.imageDescriptor.imageTopPosition;
+            entry.width = image.imageDescriptor.imageWidth;
+            entry.height = image.imageDescriptor.imageHeight;
+            if (interests & GifVisitor::FrameEntries) {
+                visitor.onFrameEntry(frameCount, entry);
+            }
+            if (keep) {
+                visitor.onFrame(frameCount, entry, image, pending.data());
+            }
+            ++frameCount;
+        } else if (pending[1] == 0xF9) {
+            GraphicControlExtension extension;
+            extension.parse(input);
+            control = {};
+            control.offset = blockOffset;
+            applyControl(control, extension);
+            hasControl = true;
+            if (interests & GifVisitor::GraphicControlExtensions) {
+                visitor.onGraphicControlExtension(extension);
+            }
+        } else if (pending[1] == 0xFF && keep) {
+            ApplicationExtension extension;
+            extension.parse(input);
+            visitor.onApplicationExtension(extension, pending.data());
+        } else if (pending[1] == 0xFE && keep) {
+            CommentExtension extension;
+            extension.parse(input);
+            visitor.onCommentExtension(extension, pending.data());
+        } else if (pending[1] == 0x01) { // plain text uses up the control
+            hasControl = false;
+        }
+        keep = true;
+        pending.clear();
+        expect(State::Introducer, 1);
+    }
+};
+
+// --push: feeds a file through GifPushParser in small chunks, the way an
+// upload arrives, and composites every frame as soon as it is complete.
+struct PushPreview : GifVisitor {
+    const GifPushParser *parser = nullptr;
+    LogicScreen logicScreen;
+    Compositor compositor;
+    std::vector<uint8_t> indices;
+
+    void onScreen(const Header &, const LogicScreen &screen) override {
+        logicScreen = screen;
+        compositor.reset(screen.logicalScreenDescriptor.logicalScreenWidth,
+                         screen.logicalScreenDescriptor.logicalScreenHeight);
+    }
+
+    void onFrame(size_t n, const FrameIndexEntry &entry,
+                 const TableBasedImage &image, const uint8_t *bytes) override {
+        image.decode(bytes, indices);
+        const ColorTable &table = image.imageDescriptor.localColorTableFlag
+                                      ? image.localColorTable
+                                      : logicScreen.globalColorTabel;
+        compositor.draw(entry, indices.data(), table.lut(PixelFormat::RGBA));
+        std::cout << "frame " << n << " ready after " << parser->consumed
+                  << " bytes, dirty=" << compositor.dirty << std::endl;
+    }
+};
+
+// Decodes a GIF of any length in constant memory. The file is read in
+// fixed-size chunks through GifPushParser, each complete frame is copied
+// into a ring of `lookahead` slots, decoded (on worker threads when there
+// is more than one) and composited in order. A slot's compressed data is
+// dropped as soon as it is decoded and the slot is reused `lookahead`
+// frames later, so memory is the canvas, the disposal backup and the ring,
+// however many frames the file has.
+struct StreamingDecoder : GifVisitor {
+    struct Slot {
+        std::vector<uint8_t> data; // compressed sub-blocks `image` points to
+        TableBasedImage image;
+        FrameIndexEntry entry;
+        std::vector<uint8_t> indices;
+        uint32_t palette[256];
+        bool decoded = false;
+    };
+
+    size_t lookahead;
+    size_t threads;
+    PixelFormat format = PixelFormat::RGBA;
+    LogicScreen logicScreen;
+    Compositor compositor;
+
+    std::vector<Slot> slots;
+    std::mutex mutex;
+    std::condition_variable filled;  // a slot got a frame, or input ended
+    std::condition_variable decoded; // a worker finished a slot
+    size_t received = 0;             // frames copied into the ring
+    size_t next = 0;                 // next frame handed to a worker
+    size_t composited = 0;
+    bool finished = false;
+    std::function<void(size_t, const Compositor &)> onDecoded;
+
+    // threads == 0 uses every core; with one thread frames are decoded on
+    // the calling thread
+    explicit StreamingDecoder(size_t lookahead = 4, size_t threads = 0)
+        : lookahead(std::max<size_t>(lookahead, 1)) {
+        interests = Frames;
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        this->threads = threads;
+    }
+
+    // reads `fd` to the end and calls onFrame(size_t frame, const Compositor
+    // &) for every frame, in order; returns false on a truncated or invalid
+    // stream, after the frames that were complete
+    template <typename F> bool run(int fd, F onFrame) {
+        std::vector<uint8_t> chunk(64 * 1024);
+        return decode(onFrame, [&](GifPushParser &parser) {
+            ssize_t n;
+            while ((n = ::read(fd, chunk.data(), chunk.size())) > 0 &&
+                   parser.feed(chunk.data(), n)) {
+                countRead(n);
+            }
+        });
+    }
+
+    // Same, but the file comes in through the source's readahead: the
+    // parser takes whatever has arrived while the next blocks are read, and
+    // blocks are handed back once the parser is past them.
+    template <typename F> bool run(ByteSource &source, F onFrame) {
+        return decode(onFrame, [&](GifPushParser &parser) {
+            for (uint64_t pos = 0; pos < source.size();) {
+                uint64_t end = source.ensure(pos, 1);
+                if (end <= pos ||
+                    !parser.feed(source.data() + pos, end - pos)) {
+                    break;
+                }
+                pos = end;
+                source.discard(pos);
+            }
+        });
+    }
+
+    // pump(GifPushParser &) feeds the whole input
+    template <typename F, typename Pump> bool decode(F onFrame, Pump pump) {
+        onDecoded = onFrame;
+        slots = std::vector<Slot>(lookahead);
+        received = next = composited = 0;
+        finished = false;
+
+        std::vector<std::thread> pool;
+        if (threads > 1) {
+            for (size_t t = 0; t < threads; ++t) {
+                pool.emplace_back([this] { work(); });
+            }
+        }
+
+        GifPushParser parser(*this);
+        pump(parser);
+        while (composited < received) {
+            compositeNext();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        filled.notify_all();
+        for (auto &thread : pool) {
+            thread.join();
+        }
+        return parser.done();
+    }
+
+    void work() {
+        while (true) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                filled.wait(lock, [&] { return finished || next < received; });
+                if (next >= received) {
+                    return;
+                }
+                i = next++;
+            }
+            decodeSlot(slots[i % lookahead]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots[i % lookahead].decoded = true;
+            }
+            decoded.notify_all();
+        }
+    }
+
+    void decodeSlot(Slot &slot) {
+        slot.image.decode(slot.data.data(), slot.indices);
+        slot.data.clear();
+    }
+
+    void compositeNext() {
+        Slot &slot = slots[composited % lookahead];
+        if (threads > 1) {
+            std::unique_lock<std::mutex> lock(mutex);
+            decoded.wait(lock, [&] { return slot.decoded; });
+        } else {
+            decodeSlot(slot);
+        }
+        compositor.draw(slot.entry, slot.indices.data(), slot.palette);
+        onDecoded(composited, static_cast<const Compositor &>(compositor));
+        std::lock_guard<std::mutex> lock(mutex);
+        slot.decoded = false;
+        ++composited;
+    }
+
+    void onScreen(const Header &, const LogicScreen &screen) override {
+        logicScreen = screen;
+        compositor.reset(screen.logicalScreenDescriptor.logicalScreenWidth,
+                         screen.logicalScreenDescriptor.logicalScreenHeight);
+    }
+
+    void onFrame(size_t n, const FrameIndexEntry &entry,
+                 const TableBasedImage &image, const uint8_t *bytes) override {
+        // the ring is full: make room by finishing the oldest frame
+        while (n >= composited + lookahead) {
+            compositeNext();
+        }
+        Slot &slot = slots[n % lookahead];
+        // keep just the compressed data, rebased to the start of the slot
+        const SubBlockChain &chain = image.imageData.imageData;
+        slot.data.assign(bytes + chain.offset,
+                         bytes + chain.offset + chain.length);
+        slot.image = image;
+        slot.image.imageData.imageData.offset = 0;
+        slot.entry = entry;
+        const ColorTable &table = image.imageDescriptor.localColorTableFlag
+                                      ? image.localColorTable
+                                      : logicScreen.globalColorTabel;
+        std::copy_n(table.lut(format), 256, slot.palette);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++received;
+        }
+        filled.notify_one();
+    }
+};
+
+// First-frame thumbnail for the "give me a small preview" case. The walk
+// stops at the first image, whose indices are area-averaged straight from
+// the palette into the target: every screen pixel falls into exactly one
+// thumbnail pixel, which averages the opaque pixels it covers and takes
+// their share as its alpha. Only the frame's index buffer (one byte per
+// pixel, kept from one build to the next) and the thumbnail itself are
+// allocated, never a full-resolution RGBA canvas.
+struct Thumbnail {
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint32_t> pixels; // RGBA, like the compositor's canvas
+
+    // scales the screen so its longer side is at most `maxSize`
+    bool build(const uint8_t *data, size_t size, size_t maxSize) {
+        struct FirstFrame : GifVisitor {
+            Thumbnail &thumbnail;
+            size_t maxSize;
+            LogicScreen logicScreen;
+            bool found = false;
+            FirstFrame(Thumbnail &thumbnail, size_t maxSize)
+                : thumbnail(thumbnail), maxSize(maxSize) {
+                interests = Frames;
+            }
+            void onScreen(const Header &, const LogicScreen &screen) override {
+                logicScreen = screen;
+            }
+            void onFrame(size_t, const FrameIndexEntry &entry,
+                         const TableBasedImage &image,
+                         const uint8_t *bytes) override {
+                const ColorTable &table =
+                    image.imageDescriptor.localColorTableFlag
+                        ? image.localColorTable
+                        : logicScreen.globalColorTabel;
+                thumbnail.draw(logicScreen, entry, image, bytes,
+                               table.lut(PixelFormat::RGBA), maxSize);
+                found = true;
+                stop = true;
+            }
+        } visitor(*this, maxSize);
+
+        ByteCursor input(data, size);
+        return walkGif(input, visitor) && visitor.found;
+    }
+
+    void draw(const LogicScreen &logicScreen, const FrameIndexEntry &frame,
+              const TableBasedImage &image, const uint8_t *bytes,
+              const uint32_t palette[256], size_t maxSize) {
+        const auto &screen = logicScreen.logicalScreenDescriptor;
+        size_t screenWidth = std::max<size_t>(screen.logicalScreenWidth, 1);
+        size_t screenHeight = std::max<size_t>(screen.logicalScreenHeight, 1);
+        size_t longer = std::max(screenWidth, screenHeight);
+        maxSize = std::max<size_t>(std::min(maxSize, longer), 1);
+        width = std::max<size_t>(screenWidth * maxSize / longer, 1);
+        height = std::max<size_t>(screenHeight * maxSize / longer, 1);
+        pixels.assign(width * height, 0);
+
+        size_t left = std::min<size_t>(frame.left, screenWidth);
+        size_t right = std::min<size_t>(left + frame.width, screenWidth);
+        size_t top = std::min<size_t>(frame.top, screenHeight);
+        size_t bottom = std::min<size_t>(top + frame.height, screenHeight);
+
+        // each thumbnail column covers screen columns [cellStart, next
+        // cellStart); `runs` is that range clipped to the frame, in frame
+        // columns
+        std::vector<uint32_t> cellStart(width + 1);
+        for (size_t x = 0; x <= width; ++x) {
+            cellStart[x] =
+                static_cast<uint32_t>((x * screenWidth + width - 1) / width);
+        }
+        std::vector<std::pair<uint32_t, uint32_t>> runs(width);
+        size_t widestCell = 1;
+        for (size_t x = 0; x < width; ++x) {
+            runs[x] = {std::clamp<uint32_t>(cellStart[x], left, right) - left,
+                       std::clamp<uint32_t>(cellStart[x + 1], left, right) -
+                           left};
+            widestCell = std::max<size_t>(widestCell,
+                                          cellStart[x + 1] - cellStart[x]);
+        }
+
+        size_t size = size_t(frame.width) * frame.height;
+        size_t decoded = image.decode(bytes, indices);
+        if (decoded < size) {
+            // a truncated frame, over whatever the last build left here
+            std::fill_n(indices.begin() + decoded, size - decoded, 0);
+        }
+
+        // palette entries widened to four 16-bit lanes (red, green, blue and
+        // an opaque count) so that a pixel is a single add; the transparent
+        // index adds nothing
+        uint64_t wide[256];
+        for (int i = 0; i < 256; ++i) {
+            uint64_t color = palette[i];
+            wide[i] = (color & 0xFF) | (color & 0xFF00) << 8 |
+                      (color & 0xFF0000) << 16 | uint64_t(1) << 48;
+        }
+        if (frame.transparentColorFlag) {
+            wide[frame.transparentColorIndex] = 0;
+        }
+
+        // A lane holds 256 pixels of 255 at most, so each column's packed
+        // lanes take whole rows of its cell and are spread into `sums` (red,
+        // green, blue and opaque count per column) every `flushRows` rows.
+        // Cells wider than 256 pixels are spread every 256 pixels instead.
+        size_t flushRows = std::max<size_t>(1, 256 / widestCell);
+        std::vector<uint64_t> lanes(width);
+        std::vector<uint64_t> sums(width * 4);
+        auto spread = [](uint64_t lanes, uint64_t *sum) {
+            sum[0] += lanes & 0xFFFF;
+            sum[1] += (lanes >> 16) & 0xFFFF;
+            sum[2] += (lanes >> 32) & 0xFFFF;
+            sum[3] += lanes >> 48;
+        };
+        auto flush = [&] {
+            for (size_t x = 0; x < width; ++x) {
+                spread(lanes[x], sums.data() + x * 4);
+                lanes[x] = 0;
+            }
+        };
+
+        size_t y = 0;
+        for (size_t row = 0; row < height; ++row) {
+            std::fill(sums.begin(), sums.end(), 0);
+            size_t cellHeight = 0;
+            size_t pending = 0; // rows in `lanes`
+            for (; y < screenHeight && y * height / screenHeight == row; ++y) {
+                ++cellHeight;
+                if (y < top || y >= bottom || left >= right) {
+                    continue;
+                }
+                const uint8_t *src = indices.data() + (y - top) * frame.width;
+                for (size_t x = 0; x < width; ++x) {
+                    for (size_t i = runs[x].first; i < runs[x].second;) {
+                        size_t end = std::min<size_t>(i + 256, runs[x].second);
+                        // two chains, so consecutive adds do not wait on
+                        // each other
+                        uint64_t even = 0, odd = 0;
+                        for (; i + 1 < end; i += 2) {
+                            even += wide[src[i]];
+                            odd += wide[src[i + 1]];
+                        }
+                        if (i < end) {
+                            even += wide[src[i++]];
+                        }
+                        if (widestCell > 256) {
+                            spread(even + odd, sums.data() + x * 4);
+                        } else {
+                            lanes[x] += even + odd;
+                        }
+                    }
+                }
+                if (++pending == flushRows) {
+                    flush();
+                    pending = 0;
+                }
+            }
+            if (pending > 0) {
+                flush();
+            }
+            for (size_t x = 0; x < width; ++x) {
+                const uint64_t *sum = sums.data() + x * 4;
+                if (sum[3] == 0) {
+                    continue;
+                }
+                uint64_t area = uint64_t(cellStart[x + 1] - cellStart[x]) *
+                                cellHeight;
+                uint32_t red = static_cast<uint32_t>(sum[0] / sum[3]);
+                uint32_t green = static_cast<uint32_t>(sum[1] / sum[3]);
+                uint32_t blue = static_cast<uint32_t>(sum[2] / sum[3]);
+                uint32_t alpha = static_cast<uint32_t>(sum[3] * 255 / area);
+                pixels[row * width + x] =
+                    red | green << 8 | blue << 16 | alpha << 24;
+            }
+        }
+    }
+
+    // writes the thumbnail as a PAM (RGB_ALPHA) image
+    bool save(const std::string &path) const {
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        fprintf(file, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL 255\n"
+                      "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                width, height);
+        for (uint32_t pixel : pixels) {
+            uint8_t rgba[4] = {static_cast<uint8_t>(pixel),
+                               static_cast<uint8_t>(pixel >> 8),
+                               static_cast<uint8_t>(pixel >> 16),
+                               static_cast<uint8_t>(pixel >> 24)};
+            fwrite(rgba, 1, 4, file);
+        }
+        return fclose(file) == 0;
+    }
+
+  private:
+    std::vector<uint8_t> indices; // the frame's, kept between builds
+};
+
+// Median-cut palette quantizer. Pixels are counted into a histogram of
+// 5 bits per channel, built in slices on several threads and merged; the
+// cut then only looks at the occupied bins, a few thousand for most
+// frames, however large the image. Each box's color is the mean of the
+// pixels in it, and a pixel gets the index of the box its bin fell in.
+// The histograms are kept between calls and only their occupied bins are
+// cleared, so a small frame costs little more than its pixels.
+struct PaletteQuantizer {
+    static constexpr int binCount = 1 << 15;
+
+    size_t threads = 1;
+
+    // Fills `palette` with at most `colors` entries for the width x height
+    // pixels at `pixels` (rows `stride` apart) and writes their indices to
+    // `indices`. Pixels with alpha below 128 get an entry of their own,
+    // taken out of `colors`; its index is returned, or -1 when there are
+    // none.
+    int quantize(const uint32_t *pixels, size_t width, size_t height,
+                 size_t stride, int colors, ColorTable &palette,
+                 uint8_t *indices) {
+        size_t slices = sliceCount(height);
+        if (histograms.size() < slices) {
+            histograms.resize(slices);
+            occupied.resize(slices);
+        }
+        std::vector<size_t> transparent(slices);
+        forEachSlice(height, [&](size_t slice, size_t top, size_t bottom) {
+            auto &histogram = histograms[slice];
+            auto &used = occupied[slice];
+            if (histogram.empty()) {
+                histogram.resize(binCount);
+            }
+            for (size_t y = top; y < bottom; ++y) {
+                const uint32_t *row = pixels + y * stride;
+                for (size_t x = 0; x < width; ++x) {
+                    uint32_t pixel = row[x];
+                    if (pixel < 0x80000000u) {
+                        ++transparent[slice];
+                        continue;
+                    }
+                    int b = binOf(pixel);
+                    Bin &bin = histogram[b];
+                    if (bin.count++ == 0) {
+                        used.push_back(static_cast<uint16_t>(b));
+                    }
+                    // the bin fixes the top 5 bits; only the rest vary
+                    bin.red += pixel & 0x07;
+                    bin.green += pixel >> 8 & 0x07;
+                    bin.blue += pixel >> 16 & 0x07;
+                }
+            }
+        });
+        std::vector<Bin> &histogram = histograms[0];
+        std::vector<uint16_t> &bins = occupied[0];
+        for (size_t t = 1; t < slices; ++t) {
+            for (uint16_t b : occupied[t]) {
+                Bin &from = histograms[t][b];
+                Bin &to = histogram[b];
+                if (to.count == 0) {
+                    bins.push_back(b);
+                }
+                to.count += from.count;
+                to.red += from.red;
+                to.green += from.green;
+                to.blue += from.blue;
+                from = Bin{};
+            }
+            occupied[t].clear();
+            transparent[0] += transparent[t];
+        }
+
+        bool hasTransparent = transparent[0] > 0;
+        colors = std::clamp(colors - hasTransparent, 1, 256 - hasTransparent);
+        std::vector<Box> boxes = cut(histogram, bins, colors);
+
+        palette = ColorTable();
+        for (size_t b = 0; b < boxes.size(); ++b) {
+            uint64_t count = 0, red = 0, green = 0, blue = 0;
+            for (size_t i = boxes[b].begin; i < boxes[b].end; ++i) {
+                const Bin &bin = histogram[bins[i]];
+                uint64_t n = bin.count;
+                count += n;
+                red += bin.red + n * (channel(bins[i], 0) << 3);
+                green += bin.green + n * (channel(bins[i], 1) << 3);
+                blue += bin.blue + n * (channel(bins[i], 2) << 3);
+                lut[bins[i]] = static_cast<uint8_t>(b);
+            }
+            palette.set(static_cast<int>(b), red / count, green / count,
+                        blue / count);
+        }
+        int transparentIndex =
+            hasTransparent ? static_cast<int>(boxes.size()) : -1;
+        palette.size = static_cast<uint16_t>(boxes.size() + hasTransparent);
+        if (palette.size == 0) {
+            palette.size = 1; // an empty image still needs an entry
+        }
+        for (uint16_t b : bins) {
+            histogram[b] = Bin{};
+        }
+        bins.clear();
+
+        forEachSlice(height, [&](size_t, size_t top, size_t bottom) {
+            for (size_t y = top; y < bottom; ++y) {
+                const uint32_t *row = pixels + y * stride;
+                uint8_t *out = indices + y * width;
+                for (size_t x = 0; x < width; ++x) {
+                    uint32_t pixel = row[x];
+                    out[x] = pixel < 0x80000000u
+                                 ? static_cast<uint8_t>(transparentIndex)
+                                 : lut[binOf(pixel)];
+                }
+            }
+        });
+        return transparentIndex;
+    }
+
+  private:
+    struct Bin {
+        uint32_t count = 0;
+        uint32_t red = 0; // sums of the low 3 bits
+        uint32_t green = 0;
+        uint32_t blue = 0;
+    };
+
+    // A run [begin, end) of occupied bins, with the channel it would be
+    // cut along and how much cutting it is worth: pixels times the range
+    // of that channel.
+    struct Box {
+        size_t begin;
+        size_t end;
+        int channel = 0;
+        uint64_t score = 0;
+    };
+
+    std::vector<std::vector<Bin>> histograms; // per slice
+    std::vector<std::vector<uint16_t>> occupied;
+    uint8_t lut[binCount]; // bin -> palette index, for occupied bins only
+
+    static int binOf(uint32_t pixel) {
+        return (pixel >> 3 & 0x1F) | (pixel >> 6 & 0x3E0) |
+               (pixel >> 9 & 0x7C00);
+    }
+
+    static int channel(uint16_t bin, int c) { return bin >> (5 * c) & 0x1F; }
+
+    size_t sliceCount(size_t rows) const {
+        // a slice is worth a thread only if it is big enough
+        return std::max<size_t>(1, std::min(threads, rows / 16));
+    }
+
+    template <typename F> void forEachSlice(size_t rows, F f) const {
+        size_t slices = sliceCount(rows);
+        if (slices == 1) {
+            f(0, 0, rows);
+            return;
+        }
+        WorkStealingPool::run(slices, slices, [&](size_t, size_t slice) {
+            f(slice, rows * slice / slices, rows * (slice + 1) / slices);
+        });
+    }
+
+    static Box makeBox(const std::vector<Bin> &histogram,
+                       const std::vector<uint16_t> &bins, size_t begin,
+                       size_t end) {
+        Box box = {begin, end};
+        if (end - begin < 2) {
+            return box; // nothing left to cut
+        }
+        int low[3] = {31, 31, 31};
+        int high[3] = {0, 0, 0};
+        uint64_t count = 0;
+        for (size_t i = begin; i < end; ++i) {
+            for (int c = 0; c < 3; ++c) {
+                low[c] = std::min(low[c], channel(bins[i], c));
+                high[c] = std::max(high[c], channel(bins[i], c));
+            }
+            count += histogram[bins[i]].count;
+        }
+        for (int c = 0; c < 3; ++c) {
+            uint64_t score = count * (high[c] - low[c]);
+            if (score > box.score) {
+                box.channel = c;
+                box.score = score;
+            }
+        }
+        return box;
+    }
+
+    // Cuts the most worthwhile box at the pixel median of its channel
+    // until there are `colors` boxes or every box is a single bin.
+    static std::vector<Box> cut(const std::vector<Bin> &histogram,
+                                std::vector<uint16_t> &bins, int colors) {
+        std::vector<Box> boxes;
+        if (bins.empty()) {
+            return boxes;
+        }
+        boxes.push_back(makeBox(histogram, bins, 0, bins.size()));
+        while (boxes.size() < static_cast<size_t>(colors)) {
+            auto best = std::max_element(
+                boxes.begin(), boxes.end(),
+                [](const Box &a, const Box &b) { return a.score < b.score; });
+            if (best->score == 0) {
+                break;
+            }
+            Box box = *best;
+            auto first = bins.begin() + box.begin;
+            auto last = bins.begin() + box.end;
+            int c = box.channel;
+            std::sort(first, last, [c](uint16_t a, uint16_t b) {
+                return channel(a, c) < channel(b, c);
+            });
+            uint64_t total = 0;
+            for (auto i = first; i != last; ++i) {
+                total += histogram[*i].count;
+            }
+            // the median, kept off both ends so neither half is empty
+            uint64_t seen = 0;
+            size_t split = box.begin;
+            while (split < box.end - 1 && seen * 2 < total) {
+                seen += histogram[bins[split++]].count;
+            }
+            split = std::max(split, box.begin + 1);
+            *best = makeBox(histogram, bins, box.begin, split);
+            boxes.push_back(makeBox(histogram, bins, split, box.end));
+        }
+        return boxes;
+    }
+};
+
+// Writes an animated GIF89a from RGBA canvases (the Compositor's layout).
+// Each frame gets its own local color table. Past the first, a frame only
+// covers the rectangle that changed since the previous canvas, with the
+// pixels inside it that did not change left transparent, which leaves long
+// runs for LZW. A frame with transparent pixels of its own can only be
+// drawn on a cleared canvas, so it is written whole and the frame before
+// it is written whole too, to be restored to the background.
+//
+// How a frame is written depends only on the canvases before and after
+// it, so addFrames() encodes a batch on separate threads and appends the
+// results in order. The last frame of a batch waits for the next batch,
+// or finish(), to know what follows it. With fewer frames than threads the
+// spare threads go to the quantizer.
+struct GifEncoder {
+    struct Frame {
+        std::vector<uint32_t> pixels; // width * height
+        uint16_t delayTime = 0;       // hundredths of a second
+    };
+
+    uint16_t width = 0;
+    uint16_t height = 0;
+    size_t threads;
+    int colors = 256;       // per frame, the transparent entry included
+    uint16_t loopCount = 0; // 0 loops forever
+    std::string out;        // the file so far; callers may drain it
+    size_t frameCount = 0;
+
+    // threads == 0 uses every core
+    explicit GifEncoder(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        this->threads = threads;
+    }
+
+    void begin(uint16_t w, uint16_t h) {
+        width = w;
+        height = h;
+        previous.clear();
+        frameCount = 0;
+
+        Header header;
+        std::memcpy(header.signature, "GIF", 3);
+        std::memcpy(header.version, "89a", 3);
+        header.write(out);
+
+        LogicScreen screen;
+        auto &descriptor = screen.logicalScreenDescriptor;
+        descriptor.logicalScreenWidth = width;
+        descriptor.logicalScreenHeight = height;
+        descriptor.globalColorTableFlag = false;
+        descriptor.colorResolution = 8;
+        descriptor.sortFlag = false;
+        descriptor.sizeOfGlobalColorTable = 1;
+        descriptor.backgroundColorIndex = 0;
+        descriptor.pixelAspectRatio = 0;
+        descriptor.packFields();
+        screen.write(out);
+
+        // NETSCAPE2.0 Application Extension: loop count sub-block
+        out += std::string("\x21\xFF\x0B" "NETSCAPE2.0\x03\x01", 16);
+        appendField(out, loopCount);
+        out.push_back(0);
+    }
+
+    void addFrames(std::vector<Frame> frames) {
+        if (frames.empty()) {
+            return;
+        }
+        if (held) {
+            frames.insert(frames.begin(), std::move(*held));
+        }
+        held = std::move(frames.back());
+        frames.pop_back();
+        encode(frames, &*held);
+    }
+
+    // writes the frame still held back and the Trailer
+    void finish() {
+        if (held) {
+            std::vector<Frame> last;
+            last.push_back(std::move(*held));
+            held.reset();
+            encode(last, nullptr);
+        }
+        out.push_back(0x3B);
+    }
+
+  private:
+    std::vector<uint32_t> previous; // canvas after the last frame written
+    std::optional<Frame> held;      // added, but not written yet
+    std::vector<PaletteQuantizer> quantizers; // one per worker, reused
+
+    // writes `frames`, which `next` follows
+    void encode(const std::vector<Frame> &frames, const Frame *next) {
+        if (frames.empty()) {
+            return;
+        }
+        std::vector<std::string> encoded(frames.size());
+        quantizers.resize(threads);
+        for (auto &quantizer : quantizers) {
+            quantizer.threads = std::max<size_t>(1, threads / frames.size());
+        }
+        WorkStealingPool::run(
+            frames.size(), threads, [&](size_t worker, size_t i) {
+                const std::vector<uint32_t> *before =
+                    i > 0 ? &frames[i - 1].pixels
+                          : previous.empty() ? nullptr : &previous;
+                const Frame *after = i + 1 < frames.size() ? &frames[i + 1]
+                                                           : next;
+                encodeFrame(frames[i], before, after, quantizers[worker],
+                            encoded[i]);
+            });
+        for (const auto &frame : encoded) {
+            out += frame;
+        }
+        previous = frames.back().pixels;
+        frameCount += frames.size();
+    }
+
+    static bool hasTransparency(const std::vector<uint32_t> &pixels) {
+        return std::any_of(pixels.begin(), pixels.end(),
+                           [](uint32_t p) { return p < 0x80000000u; });
+    }
+
+    void encodeFrame(const Frame &frame, const std::vector<uint32_t> *before,
+                     const Frame *next, PaletteQuantizer &quantizer,
+                     std::string &result) const {
+        const size_t w = width;
+        const uint32_t *pixels = frame.pixels.data();
+        Rect rect = {0, 0, w, height};
+        std::vector<uint32_t> changes;
+        // the next frame needs a cleared canvas: this one covers it all
+        bool restore = next && hasTransparency(next->pixels);
+        bool delta = before && !restore && !hasTransparency(frame.pixels);
+        if (delta) {
+            size_t left = w, right = 0, top = height, bottom = 0;
+            for (size_t y = 0; y < height; ++y) {
+                const uint32_t *a = pixels + y * w;
+                const uint32_t *b = before->data() + y * w;
+                size_t x = 0;
+                while (x < w && a[x] == b[x]) {
+                    ++x;
+                }
+                if (x == w) {
+                    continue;
+                }
+                size_t end = w;
+                while (a[end - 1] == b[end - 1]) {
+                    --end;
+                }
+                left = std::min(left, x);
+                right = std::max(right, end);
+                top = std::min(top, y);
+                bottom = y + 1;
+            }
+            // an unchanged frame still needs one pixel to carry its delay
+            rect = right > left ? Rect{left, top, right - left, bottom - top}
+                                : Rect{0, 0, 1, 1};
+            changes.resize(rect.area());
+            for (size_t y = 0; y < rect.height; ++y) {
+                const uint32_t *a = pixels + (rect.top + y) * w + rect.left;
+                const uint32_t *b =
+                    before->data() + (rect.top + y) * w + rect.left;
+                uint32_t *c = changes.data() + y * rect.width;
+                for (size_t x = 0; x < rect.width; ++x) {
+                    c[x] = a[x] == b[x] ? 0 : a[x];
+                }
+            }
+        }
+
+        TableBasedImage image;
+        std::vector<uint8_t> indices(rect.area());
+        int transparentIndex =
+            delta ? quantizer.quantize(changes.data(), rect.width,
+                                       rect.height, rect.width, colors,
+                                       image.localColorTable, indices.data())
+                  : quantizer.quantize(pixels, w, height, w, colors,
+                                       image.localColorTable, indices.data());
+
+        GraphicControlExtension control;
+        control.extensionIntroducer = 0x21;
+        control.graphicControlLabel = 0xF9;
+        control.blockSize = 4;
+        control.reserved = 0;
+        control.disposalMethod = restore ? 2 : 1;
+        control.userInputFlag = false;
+        control.transparentColorFlag = transparentIndex >= 0;
+        control.delayTime = frame.delayTime;
+        control.transparentColorIndex =
+            static_cast<uint8_t>(std::max(transparentIndex, 0));
+        control.blockTerminator = 0;
+        control.packFields();
+        control.write(result);
+
+        auto &descriptor = image.imageDescriptor;
+        descriptor.imageSeparator = 0x2C;
+        descriptor.imageLeftPosition = static_cast<uint16_t>(rect.left);
+        descriptor.imageTopPosition = static_cast<uint16_t>(rect.top);
+        descriptor.imageWidth = static_cast<uint16_t>(rect.width);
+        descriptor.imageHeight = static_cast<uint16_t>(rect.height);
+        descriptor.localColorTableFlag = true;
+        descriptor.interlaceFlag = false;
+        descriptor.sortFlag = false;
+        descriptor.reserved = 0;
+        descriptor.sizeOfLocalColorTable = image.localColorTable.size - 1;
+        descriptor.packFields();
+        descriptor.write(result);
+        image.localColorTable.write(result);
+
+        // the code size is the table's bit count, but at least 2
+        uint8_t minCodeSize = std::max<uint8_t>(
+            2, colorTableBits(image.localColorTable.size) + 1);
+        result.push_back(static_cast<char>(minCodeSize));
+        LzwEncoder lzw;
+        lzw.encode(indices.data(), indices.size(), minCodeSize, result);
+    }
+};
+
+// Box-filters an RGBA canvas down to `width` x `height`, the way Thumbnail
+// does: colors are averaged over the opaque pixels of a cell and alpha is
+// the share of them.
+std::vector<uint32_t> downscale(const std::vector<uint32_t> &canvas,
+                                size_t canvasWidth, size_t canvasHeight,
+                                size_t width, size_t height) {
+    std::vector<uint32_t> out(width * height, 0);
+    for (size_t row = 0; row < height; ++row) {
+        size_t y0 = row * canvasHeight / height;
+        size_t y1 = std::max((row + 1) * canvasHeight / height, y0 + 1);
+        for (size_t col = 0; col < width; ++col) {
+            size_t x0 = col * canvasWidth / width;
+            size_t x1 = std::max((col + 1) * canvasWidth / width, x0 + 1);
+            uint64_t red = 0, green = 0, blue = 0, opaque = 0;
+            for (size_t y = y0; y < y1; ++y) {
+                const uint32_t *p = canvas.data() + y * canvasWidth;
+                for (size_t x = x0; x < x1; ++x) {
+                    if (p[x] >= 0x80000000u) {
+                        red += p[x] & 0xFF;
+                        green += p[x] >> 8 & 0xFF;
+                        blue += p[x] >> 16 & 0xFF;
+                        ++opaque;
+                    }
+                }
+            }
+            if (opaque == 0) {
+                continue;
+            }
+            uint64_t area = (y1 - y0) * (x1 - x0);
+            out[row * width + col] =
+                static_cast<uint32_t>(red / opaque) |
+                static_cast<uint32_t>(green / opaque) << 8 |
+                static_cast<uint32_t>(blue / opaque) << 16 |
+                static_cast<uint32_t>(opaque * 255 / area) << 24;
+        }
+    }
+    return out;
+}
+
+// --batch: summarizes many GIFs, one JSON line per file. Workers read each
+// file into a buffer they keep for the whole batch and walk only the frame
+// placements; nothing is decoded.
+struct GifBatchScanner {
+    struct Summary : GifVisitor {
+        uint16_t width = 0;
+        uint16_t height = 0;
+        size_t frames = 0;
+        uint64_t delay = 0; // hundredths of a second
+        bool complete = false;
+        int64_t errorOffset = -1;
+
+        Summary() { interests = FrameEntries; }
+        void onScreen(const Header &, const LogicScreen &screen) override {
+            width = screen.logicalScreenDescriptor.logicalScreenWidth;
+            height = screen.logicalScreenDescriptor.logicalScreenHeight;
+        }
+        void onFrameEntry(size_t, const FrameIndexEntry &entry) override {
+            ++frames;
+            delay += entry.delayTime;
+        }
+        void onTrailer() override { complete = true; }
+        void onError(uint64_t offset, int) override { errorOffset = offset; }
+    };
+
+    struct Worker {
+        std::vector<uint8_t> buffer; // reused for every file
+        std::string out;             // records not yet written
+    };
+
+    size_t threads = std::thread::hardware_concurrency();
+    size_t errors = 0;  // files whose record has an error
+    uint64_t bytes = 0; // bytes of all files read
+
+    // reads `path` into `buffer`; false if it cannot be read
+    static bool readFile(const std::string &path, std::vector<uint8_t> &buffer,
+                         size_t &size) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        size = ok ? st.st_size : 0;
+        if (buffer.size() < size) {
+            buffer.resize(size);
+        }
+        for (size_t done = 0; ok && done < size;) {
+            ssize_t n = pread(fd, buffer.data() + done, size - done, done);
+            if (n <= 0) {
+                size = done;
+                break;
+            }
+            done += n;
+        }
+        close(fd);
+        return ok;
+    }
+
+    // appends the record of `path`; false if it has an error
+    bool scan(const std::string &path, Worker &worker, size_t &size) {
+        std::string &out = worker.out;
+        out += "{\"path\":";
+        appendJson(out, path);
+
+        size = 0;
+        std::string error;
+        Summary summary;
+        if (!readFile(path, worker.buffer, size)) {
+            error = "cannot read file";
+        } else if (size < 6 || std::memcmp(worker.buffer.data(), "GIF8", 4)) {
+            error = "not a gif file";
+        } else {
+            ByteCursor input(worker.buffer.data(), size);
+            if (!walkGif(input, summary)) {
+                error = "bad logical screen";
+            } else if (!summary.complete) {
+                error = "truncated at " +
+                        std::to_string(std::max<int64_t>(summary.errorOffset,
+                                                         0));
+            }
+        }
+
+        char fields[160];
+        snprintf(fields, sizeof(fields),
+                 ",\"size\":%zu,\"codec\":\"gif\",\"width\":%u,\"height\":%u,"
+                 "\"frames\":%zu,\"duration\":%.2f,\"error\":",
+                 size, summary.width, summary.height, summary.frames,
+                 summary.delay / 100.0);
+        out += fields;
+        if (error.empty()) {
+            out += "null";
+        } else {
+            appendJson(out, error);
+        }
+        out += "}\n";
+        return error.empty();
+    }
+
+    // writes one record per file to `output`, in no particular order
+    void run(const std::vector<std::string> &files, FILE *output) {
+        threads = std::max<size_t>(1, threads);
+        std::vector<Worker> workers(threads);
+        std::mutex outputMutex;
+        std::atomic<size_t> failed{0};
+        std::atomic<uint64_t> total{0};
+        auto flush = [&](Worker &worker) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            fwrite(worker.out.data(), 1, worker.out.size(), output);
+            worker.out.clear();
+        };
+        WorkStealingPool::run(
+            files.size(), workers.size(), [&](size_t w, size_t task) {
+                Worker &worker = workers[w];
+                size_t size = 0;
+                if (!scan(files[task], worker, size)) {
+                    ++failed;
+                }
+                total += size;
+                if (worker.out.size() >= 64 << 10) {
+                    flush(worker);
+                }
+            });
+        for (auto &worker : workers) {
+            flush(worker);
+        }
+        errors = failed;
+        bytes = total;
+    }
+};
+
+// --bench: decode throughput on a given file and on synthetic GIFs.
+
+// Writes a GIF89a with a 256-entry global color table and `frames` frames.
+// `noise` mixes random low bits into a gradient, from 0 (smooth, highly
+// compressible) to 8 (pure noise). Every `keyInterval`-th frame covers the
+// whole screen; the others redraw a moving quarter-size rectangle with
+// index 0 transparent, the way most animations are made. Image data is cut
+// into sub-blocks of `subBlockSize` bytes; 1 is legal and the worst case
+// for anything that walks sub-blocks.
+std::string makeSyntheticGif(uint16_t width, uint16_t height, int frames,
+                             int noise, int keyInterval = 1,
+                             size_t subBlockSize = 255) {
+    std::string gif = "GIF89a";
+    auto put16 = [&gif](uint16_t v) {
+        gif.push_back(static_cast<char>(v & 0xFF));
+        gif.push_back(static_cast<char>(v >> 8));
+    };
+    put16(width);
+    put16(height);
+    gif += std::string("\xF7\x00\x00", 3);
+    for (int i = 0; i < 256; ++i) {
+        gif.push_back(static_cast<char>(i));
+        gif.push_back(static_cast<char>(255 - i));
+        gif.push_back(static_cast<char>(i * 7));
+    }
+
+    LzwEncoder encoder;
+    encoder.blockSize = subBlockSize;
+    std::vector<uint8_t> pixels(static_cast<size_t>(width) * height);
+    uint32_t seed = 12345;
+    uint8_t noiseMask = static_cast<uint8_t>((1 << noise) - 1);
+    for (int f = 0; f < frames; ++f) {
+        bool full = keyInterval <= 1 || f % keyInterval == 0;
+        uint16_t w = full ? width : std::max(width / 4, 1);
+        uint16_t h = full ? height : std::max(height / 4, 1);
+        uint16_t left = full ? 0 : (f * 16) % (width - w + 1);
+        uint16_t top = full ? 0 : (f * 8) % (height - h + 1);
+        for (size_t y = 0; y < h; ++y) {
+            for (size_t x = 0; x < w; ++x) {
+                seed = seed * 1103515245 + 12345;
+                uint8_t gradient = static_cast<uint8_t>((x + y + f * 8) / 8);
+                pixels[y * w + x] =
+                    (gradient & ~noiseMask) | ((seed >> 16) & noiseMask);
+            }
+        }
+        gif += full ? std::string("\x21\xF9\x04\x04\x02\x00\x00\x00", 8)
+                    : std::string("\x21\xF9\x04\x05\x02\x00\x00\x00", 8);
+        gif.push_back(0x2C);
+        put16(left);
+        put16(top);
+        put16(w);
+        put16(h);
+        gif.push_back(0x00);
+        gif.push_back(0x08);
+        encoder.encode(pixels.data(), static_cast<size_t>(w) * h, 8, gif);
+    }
+    gif.push_back(0x3B);
+    return gif;
+}
+
+// Every measurement is also recorded here; --json saves it.
+BenchReport benchReport;
+
+// Allocations made by f(), or -1 when allocations are not counted.
+template <typename F> double countAllocations(F f) {
+    long long before = allocationCount();
+    f();
+    return before < 0 ? -1 : static_cast<double>(allocationCount() - before);
+}
+
+void benchDecode(const std::string &name, const uint8_t *data, size_t size,
+                 int rounds) {
+    auto parseStart = std::chrono::steady_clock::now();
+    for (int r = 1; r < rounds; ++r) {
+        GifDataStream gif;
+        ByteCursor input(data, size);
+        gif.parse(input);
+    }
+    GifDataStream gif;
+    ByteCursor input(data, size);
+    double allocations = countAllocations([&] { gif.parse(input); });
+    auto parseEnd = std::chrono::steady_clock::now();
+    double parseSeconds =
+        std::chrono::duration<double>(parseEnd - parseStart).count();
+
+    size_t compressed = 0;
+    size_t pixels = 0;
+    for (const auto &block : gif.graphicBlocks) {
+        const auto &image = block.graphicRenderingBlock.tableBasedImage;
+        compressed += image.imageData.imageData.dataSize;
+        pixels += static_cast<size_t>(image.imageDescriptor.imageWidth) *
+                  image.imageDescriptor.imageHeight;
+    }
+
+    std::vector<uint8_t> indices;
+    size_t decoded = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (const auto &block : gif.graphicBlocks) {
+            decoded += block.graphicRenderingBlock.tableBasedImage.decode(
+                gif.bytes, indices);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    std::cout << std::fixed << std::setprecision(1)                        //
+              << name << ": frames=" << gif.graphicBlocks.size()           //
+              << ", pixels/frame=" << pixels / std::max<size_t>(
+                                                   gif.graphicBlocks.size(), 1)
+              << ", ratio=" << static_cast<double>(pixels) / std::max<size_t>(
+                                                   compressed, 1)          //
+              << ", parse " << size * rounds / parseSeconds / 1e6 << " MB/s" //
+              << " (" << gif.arena.heapBlocks() << " heap blocks)"          //
+              << ", decoded=" << decoded / rounds                          //
+              << ", " << decoded / seconds / 1e6 << " MB/s out"            //
+              << ", " << compressed * rounds / seconds / 1e6 << " MB/s in" //
+              << ", " << gif.graphicBlocks.size() * rounds / seconds
+              << " frames/s" << std::endl;
+    std::cout << std::defaultfloat;
+    benchReport.add(name, "parse",
+                    {{"mb_per_s", size * rounds / parseSeconds / 1e6},
+                     {"allocations", allocations}});
+    benchReport.add(name, "lzw decode",
+                    {{"mb_per_s_out", decoded / seconds / 1e6},
+                     {"mb_per_s_in", compressed * rounds / seconds / 1e6},
+                     {"frames_per_s",
+                      gif.graphicBlocks.size() * rounds / seconds}});
+
+    // the same indices back through the encoder, at the same code sizes
+    std::vector<std::vector<uint8_t>> frames;
+    for (const auto &block : gif.graphicBlocks) {
+        block.graphicRenderingBlock.tableBasedImage.decode(gif.bytes, indices);
+        frames.push_back(indices);
+    }
+    LzwEncoder encoder;
+    std::string encoded;
+    size_t encodedSize = 0;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            const auto &image =
+                gif.graphicBlocks[i].graphicRenderingBlock.tableBasedImage;
+            encoded.clear();
+            encoder.encode(frames[i].data(), frames[i].size(),
+                           image.imageData.lzwMinimumCodeSize, encoded);
+            encodedSize += encoded.size();
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << std::fixed << std::setprecision(1)                      //
+              << name << ": lzw encode " << decoded / seconds / 1e6      //
+              << " MB/s in, " << encodedSize / seconds / 1e6 << " MB/s out"
+              << std::endl;
+    std::cout << std::defaultfloat;
+    benchReport.add(name, "lzw encode",
+                    {{"mb_per_s_in", decoded / seconds / 1e6},
+                     {"mb_per_s_out", encodedSize / seconds / 1e6}});
+}
+
+void benchWalk(const std::string &name, const uint8_t *data, size_t size) {
+    struct Subscriber : GifVisitor {
+        size_t events = 0;
+        explicit Subscriber(unsigned wanted) { interests = wanted; }
+        void onGraphicControlExtension(
+            const GraphicControlExtension &) override {
+            ++events;
+        }
+        void onFrameEntry(size_t, const FrameIndexEntry &) override {
+            ++events;
+        }
+        void onFrame(size_t, const FrameIndexEntry &, const TableBasedImage &,
+                     const uint8_t *) override {
+            ++events;
+        }
+    };
+    struct {
+        const char *name;
+        unsigned interests;
+    } cases[] = {
+        {"delays only", GifVisitor::GraphicControlExtensions},
+        {"frame entries", GifVisitor::FrameEntries},
+        {"all", GifVisitor::All},
+    };
+    const int rounds = 20;
+    for (const auto &c : cases) {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            Subscriber subscriber(c.interests);
+            ByteCursor input(data, size);
+            walkGif(input, subscriber);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double allocations = countAllocations([&] {
+            Subscriber subscriber(c.interests);
+            ByteCursor input(data, size);
+            walkGif(input, subscriber);
+        });
+        std::cout << std::fixed << std::setprecision(1)            //
+                  << name << ": walk " << c.name                   //
+                  << ", " << size * rounds / seconds / 1e6 << " MB/s" //
+                  << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(name, std::string("walk ") + c.name,
+                        {{"mb_per_s", size * rounds / seconds / 1e6},
+                         {"allocations", allocations}});
+    }
+}
+
+void benchSeek(const std::string &name, const uint8_t *data, size_t size) {
+    GifFrameIndex index;
+    auto start = std::chrono::steady_clock::now();
+    double allocations = countAllocations([&] { index.build(data, size); });
+    auto built = std::chrono::steady_clock::now();
+
+    // a fixed pseudo-random walk, so no seek can reuse the previous canvas
+    size_t seeks = 100;
+    size_t frame = 0;
+    for (size_t i = 0; i < seeks; ++i) {
+        frame = (frame + 397) % index.frames.size();
+        index.current = SIZE_MAX;
+        index.seekFrame(frame);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double buildSeconds = std::chrono::duration<double>(built - start).count();
+    double seekSeconds = std::chrono::duration<double>(end - built).count();
+    std::cout << std::fixed << std::setprecision(3)                       //
+              << name << ": frames=" << index.frames.size()               //
+              << ", index " << size / buildSeconds / 1e6 << " MB/s"       //
+              << " (" << buildSeconds * 1e3 << " ms)"                     //
+              << ", random seek " << seekSeconds / seeks * 1e3 << " ms/seek"
+              << std::endl;
+    std::cout << std::defaultfloat;
+    benchReport.add(name, "index",
+                    {{"mb_per_s", size / buildSeconds / 1e6},
+                     {"frames_per_s", index.frames.size() / buildSeconds},
+                     {"allocations", allocations}});
+    benchReport.add(name, "random seek",
+                    {{"ms_per_seek", seekSeconds / seeks * 1e3}});
+}
+
+void benchParallel(const std::string &name, const uint8_t *data,
+                   size_t size) {
+    GifFrameIndex index;
+    index.build(data, size);
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double single = 0;
+    for (size_t threads : {size_t(1), cores}) {
+        if (threads == cores && cores == 1 && single > 0) {
+            break;
+        }
+        ParallelDecoder decoder(threads);
+        Compositor compositor;
+        size_t dirtyArea = 0;
+        auto start = std::chrono::steady_clock::now();
+        decoder.run(index, compositor,
+                    [&dirtyArea](size_t, const Compositor &c) {
+                        dirtyArea += c.dirty.area();
+                    });
+        auto end = std::chrono::steady_clock::now();
+        double fps = index.frames.size() /
+                     std::chrono::duration<double>(end - start).count();
+        if (threads == 1) {
+            single = fps;
+        }
+        std::cout << std::fixed << std::setprecision(1)                //
+                  << name << ": threads=" << threads                   //
+                  << ", " << fps << " frames/s"                        //
+                  << ", speedup " << fps / single << "x"               //
+                  << ", dirty " << 100.0 * dirtyArea /
+                                       (compositor.canvas.size() *
+                                        index.frames.size())
+                  << "%" << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(name,
+                        "parallel decode threads=" + std::to_string(threads),
+                        {{"frames_per_s", fps}, {"speedup", fps / single}});
+    }
+}
+
+void benchPalette() {
+    const size_t width = 4096;
+    const size_t height = 4096;
+    std::vector<uint8_t> indices(width * height);
+    uint32_t seed = 1;
+    for (auto &index : indices) {
+        seed = seed * 1103515245 + 12345;
+        index = static_cast<uint8_t>(seed >> 16);
+    }
+    ColorTable table;
+    std::string rgb(256 * 3, '\0');
+    for (size_t i = 0; i < rgb.size(); ++i) {
+        rgb[i] = static_cast<char>(i * 31);
+    }
+    ByteCursor input(reinterpret_cast<const uint8_t *>(rgb.data()),
+                     rgb.size());
+    table.parse(input, 256);
+
+    std::vector<uint32_t> pixels(width * height);
+    for (const PaletteKernels *kernels : PaletteKernels::supported()) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t y = 0; y < height; ++y) {
+            kernels->expand(indices.data() + y * width, width,
+                            table.lut(PixelFormat::RGBA),
+                            pixels.data() + y * width);
+        }
+        auto middle = std::chrono::steady_clock::now();
+        for (size_t y = 0; y < height; ++y) {
+            kernels->composite(indices.data() + y * width, width,
+                               table.lut(PixelFormat::BGRA), 0,
+                               pixels.data() + y * width);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double expand = std::chrono::duration<double>(middle - start).count();
+        double composite = std::chrono::duration<double>(end - middle).count();
+        std::cout << std::fixed << std::setprecision(1)                      //
+                  << "palette 4096x4096 " << kernels->name                   //
+                  << ": expand " << width * height / expand / 1e6 << " Mpx/s" //
+                  << ", composite " << width * height / composite / 1e6
+                  << " Mpx/s" << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(std::string("palette 4096x4096 ") + kernels->name,
+                        "palette",
+                        {{"expand_mpx_per_s", width * height / expand / 1e6},
+                         {"composite_mpx_per_s",
+                          width * height / composite / 1e6}});
+    }
+}
+
+void benchPush(const std::string &name, const uint8_t *data, size_t size) {
+    struct FrameCounter : GifVisitor {
+        size_t frames = 0;
+        FrameCounter() { interests = FrameEntries; }
+        void onFrameEntry(size_t, const FrameIndexEntry &) override {
+            ++frames;
+        }
+    };
+    for (size_t chunk : {size_t(1), size_t(4096), size_t(65536)}) {
+        FrameCounter counter;
+        GifPushParser parser(counter);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < size; offset += chunk) {
+            parser.feed(data + offset, std::min(chunk, size - offset));
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << std::fixed << std::setprecision(1)               //
+                  << name << ": chunk=" << chunk                      //
+                  << ", frames=" << counter.frames                    //
+                  << ", push parse " << size / seconds / 1e6 << " MB/s" //
+                  << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(name, "push parse chunk=" + std::to_string(chunk),
+                        {{"mb_per_s", size / seconds / 1e6}});
+    }
+}
+
+// Thumbnail latency against indexing the file and compositing frame 0.
+void benchThumbnail(const std::string &name, const uint8_t *data,
+                    size_t size) {
+    const int rounds = 5;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        GifFrameIndex index;
+        index.build(data, size);
+        index.seekFrame(0);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    Thumbnail thumbnail;
+    for (int r = 0; r < rounds; ++r) {
+        thumbnail.build(data, size, 256);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double full = std::chrono::duration<double>(middle - start).count();
+    double thumb = std::chrono::duration<double>(end - middle).count();
+    std::cout << std::fixed << std::setprecision(2)                       //
+              << name << ": index + frame 0 " << full / rounds * 1e3      //
+              << " ms, thumbnail " << thumbnail.width << "x"              //
+              << thumbnail.height << " " << thumb / rounds * 1e3 << " ms" //
+              << std::endl;
+    std::cout << std::defaultfloat;
+    benchReport.add(name, "thumbnail",
+                    {{"ms", thumb / rounds * 1e3},
+                     {"index_and_frame_ms", full / rounds * 1e3}});
+}
+
+// Composites every frame of `data` and re-encodes the animation, on one
+// thread and on every core.
+void benchEncode(const std::string &name, const uint8_t *data, size_t size) {
+    GifFrameIndex index;
+    index.build(data, size);
+    const auto &screen = index.logicScreen.logicalScreenDescriptor;
+    std::vector<GifEncoder::Frame> frames;
+    for (size_t i = 0; i < index.frames.size(); ++i) {
+        frames.push_back({*index.seekFrame(i), index.frames[i].delayTime});
+    }
+    size_t pixels = frames.size() * screen.logicalScreenWidth *
+                    screen.logicalScreenHeight;
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double single = 0;
+    for (size_t threads : {size_t(1), cores}) {
+        if (threads == cores && cores == 1 && single > 0) {
+            break;
+        }
+        GifEncoder encoder(threads);
+        std::vector<GifEncoder::Frame> batch = frames;
+        auto start = std::chrono::steady_clock::now();
+        encoder.begin(screen.logicalScreenWidth, screen.logicalScreenHeight);
+        encoder.addFrames(std::move(batch));
+        encoder.finish();
+        auto end = std::chrono::steady_clock::now();
+        double rate =
+            pixels / std::chrono::duration<double>(end - start).count() / 1e6;
+        if (threads == 1) {
+            single = rate;
+        }
+        std::cout << std::fixed << std::setprecision(1)                 //
+                  << name << ": encode threads=" << threads             //
+                  << ", " << rate << " Mpixels/s"                       //
+                  << ", speedup " << rate / single << "x"               //
+                  << ", " << encoder.out.size() * 100.0 / size << "% of input"
+                  << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(name, "encode threads=" + std::to_string(threads),
+                        {{"mpixels_per_s", rate},
+                         {"speedup", rate / single},
+                         {"bytes", static_cast<double>(encoder.out.size())}});
+    }
+}
+
+// Writes `gif` with its frames repeated `repeat` times, one copy at a time.
+bool writeRepeatedGif(const std::string &path, const std::string &gif,
+                      int repeat) {
+    ByteCursor input(reinterpret_cast<const uint8_t *>(gif.data()),
+                     gif.size());
+    Header header;
+    LogicScreen logicScreen;
+    header.parse(input);
+    logicScreen.parse(input);
+    size_t framesBegin = input.tell();
+    size_t framesEnd = gif.size() - 1; // the trailer
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::write(fd, gif.data(), framesBegin) ==
+              static_cast<ssize_t>(framesBegin);
+    for (int i = 0; ok && i < repeat; ++i) {
+        ok = ::write(fd, gif.data() + framesBegin, framesEnd - framesBegin) ==
+             static_cast<ssize_t>(framesEnd - framesBegin);
+    }
+    ok = ok && ::write(fd, "\x3B", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+// Runs f() in a child process and returns the child's peak RSS in KiB, or
+// -1 if f() returned false.
+template <typename F> long childPeakRss(F f) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(f() ? 0 : 1);
+    }
+    int status = 0;
+    rusage usage = {};
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+// Peak RSS of a streaming decode should not depend on the number of frames,
+// unlike decoding from a mapped file with a full frame index. Returns false
+// when it grows with them or cannot be measured; --check-stream exits
+// non-zero on that.
+bool benchStream(const std::string &name, const std::string &gif) {
+    char dir[] = "/tmp/gif_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cout << name << " stream: cannot create " << dir << std::endl;
+        return false;
+    }
+    long streamRss[2] = {};
+    long indexRss[2] = {};
+    size_t frames[2] = {};
+    const int repeats[2] = {4, 100};
+    for (int run = 0; run < 2; ++run) {
+        std::string path = std::string(dir) + "/stream.gif";
+        if (!writeRepeatedGif(path, gif, repeats[run])) {
+            std::cout << name << " stream: cannot write " << path
+                      << std::endl;
+            unlink(path.c_str());
+            rmdir(dir);
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+        streamRss[run] = childPeakRss([&] {
+            ByteSource source;
+            StreamingDecoder decoder;
+            return source.open(path) &&
+                   decoder.run(source, [](size_t, const Compositor &) {});
+        });
+        auto end = std::chrono::steady_clock::now();
+        indexRss[run] = childPeakRss([&] {
+            ByteSource mapped;
+            GifFrameIndex index;
+            if (!mapped.open(path, ByteSource::Backend::Mapped) ||
+                !index.build(mapped.data(), mapped.size())) {
+                return false;
+            }
+            ParallelDecoder decoder;
+            Compositor compositor;
+            decoder.run(index, compositor, [](size_t, const Compositor &) {});
+            return true;
+        });
+        {
+            ByteSource mapped;
+            GifFrameIndex index;
+            if (mapped.open(path, ByteSource::Backend::Mapped) &&
+                index.build(mapped.data(), mapped.size())) {
+                frames[run] = index.frames.size();
+            }
+        }
+        unlink(path.c_str());
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << std::fixed << std::setprecision(1)                     //
+                  << name << " x" << frames[run] << " stream: "             //
+                  << frames[run] / seconds << " frames/s, peak RSS "        //
+                  << streamRss[run] << " KiB (mapped + index: "             //
+                  << indexRss[run] << " KiB)" << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(name + " x" + std::to_string(frames[run]), "stream",
+                        {{"frames_per_s", frames[run] / seconds},
+                         {"peak_rss_kib", double(streamRss[run])},
+                         {"index_peak_rss_kib", double(indexRss[run])}});
+    }
+    rmdir(dir);
+    // allow for allocator noise, not for growth with the frame count
+    bool constant = streamRss[0] > 0 && streamRss[1] > 0 &&
+                    streamRss[1] <= streamRss[0] + streamRss[0] / 10 + 1024;
+    std::cout << name << " stream: peak RSS "
+              << (constant ? "constant" : "GROWS") << " from " << frames[0]
+              << " to " << frames[1] << " frames" << std::endl;
+    return constant;
+}
+
+// Parses a file that is not in the page cache, once through the io_uring
+// readahead and once through mmap.
+void benchSource(const char *file) {
+    for (auto backend :
+         {ByteSource::Backend::Auto, ByteSource::Backend::Mapped}) {
+        int fd = ::open(file, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        auto start = std::chrono::steady_clock::now();
+        ByteSource source;
+        if (!source.open(file, backend)) {
+            return;
+        }
+        GifDataStream gif;
+        ByteCursor input(source);
+        gif.parse(input);
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << std::fixed << std::setprecision(1)              //
+                  << file << ": cold parse via " << source.backend() //
+                  << ", " << source.size() / seconds / 1e6 << " MB/s"
+                  << std::endl;
+        std::cout << std::defaultfloat;
+        benchReport.add(file, std::string("cold parse ") + source.backend(),
+                        {{"mb_per_s", source.size() / seconds / 1e6}});
+    }
+}
+
+int bench(const char *file, const char *json) {
+    if (file) {
+        ByteSource mapped;
+        if (!mapped.open(file, ByteSource::Backend::Mapped)) {
+            std::cout << "file is not exists: " << file << std::endl;
+            return -1;
+        }
+        benchDecode(file, mapped.data(), mapped.size(), 200);
+        benchSource(file);
+    }
+
+    struct {
+        const char *name;
+        uint16_t width;
+        uint16_t height;
+        int frames;
+        int noise;
+        int rounds;
+    } cases[] = {
+        {"synthetic 4096x4096 smooth", 4096, 4096, 1, 0, 5},
+        {"synthetic 4096x4096 noisy", 4096, 4096, 1, 3, 5},
+        {"synthetic 4096x4096 random", 4096, 4096, 1, 8, 5},
+        {"synthetic 3840x2160 noisy", 3840, 2160, 1, 3, 5},
+        {"synthetic 640x360 x100 noisy", 640, 360, 100, 3, 3},
+    };
+    for (const auto &c : cases) {
+        std::string gif =
+            makeSyntheticGif(c.width, c.height, c.frames, c.noise);
+        benchDecode(c.name, reinterpret_cast<const uint8_t *>(gif.data()),
+                    gif.size(), c.rounds);
+    }
+
+    std::string gif = makeSyntheticGif(640, 360, 1000, 3, 50);
+    benchSeek("synthetic 640x360 x1000 key/50",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    benchWalk("synthetic 640x360 x1000 key/50",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    benchPush("synthetic 640x360 x1000 key/50",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    gif = makeSyntheticGif(64, 64, 10000, 3, 50);
+    benchSeek("synthetic 64x64 x10000 key/50",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+    benchWalk("synthetic 64x64 x10000 key/50",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    gif = makeSyntheticGif(640, 360, 100, 3, 1, 1);
+    benchDecode("adversarial 640x360 x100 1-byte sub-blocks",
+                reinterpret_cast<const uint8_t *>(gif.data()), gif.size(), 3);
+    benchWalk("adversarial 640x360 x100 1-byte sub-blocks",
+              reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    benchPalette();
+
+    gif = makeSyntheticGif(640, 360, 1000, 3);
+    benchParallel("synthetic 640x360 x1000 parallel",
+                  reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    gif = makeSyntheticGif(640, 360, 1000, 3, 50);
+    benchParallel("synthetic 640x360 x1000 key/50 parallel",
+                  reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    gif = makeSyntheticGif(4096, 4096, 10, 3, 5);
+    benchThumbnail("synthetic 4096x4096 x10",
+                   reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    gif = makeSyntheticGif(640, 360, 100, 3, 10);
+    benchEncode("synthetic 640x360 x100 key/10",
+                reinterpret_cast<const uint8_t *>(gif.data()), gif.size());
+
+    benchStream("synthetic 320x240 key/10",
+                makeSyntheticGif(320, 240, 50, 3, 10));
+
+    if (json && !benchReport.save(json, "gif_parser")) {
+        std::cout << "cannot write " << json << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    // --cache keeps the frame index of --index/--frame/--decode in
+    // "<gif>.idx" and maps it back on the next run; --stats times every
+    // block kind and counts reads and seeks, dumped as JSON on stderr
+    bool useCache = false;
+    StatsDump stats("gif_parser");
+    for (; argc > 1; --argc, ++argv) {
+        std::string flag(argv[1]);
+        if (flag == "--cache") {
+            useCache = true;
+        } else if (flag == "--stats") {
+            stats.enable();
+        } else {
+            break;
+        }
+    }
+
+    if (argc <= 1) {
+        std::cout << "Usage: gif_parser [--cache] [--stats] "
+                     "[--index | --frame <n> | --decode | --push | "
+                     "--stream | --delays | --thumbnail <size>] <gif file> "
+                     "[thumbnail.pam]"
+                  << std::endl
+                  << "       gif_parser --batch <directory | list file> "
+                     "[threads]"
+                  << std::endl
+                  << "       gif_parser --encode <gif file> <output.gif> "
+                     "[max size] [first frame] [last frame]"
+                  << std::endl
+                  << "       gif_parser --bench [gif file] "
+                     "[--json results.json]"
+                  << std::endl
+                  << "       gif_parser --check-stream" << std::endl;
+        return 0;
+    }
+
+    std::string option(argv[1]);
+    if (option == "--batch" && argc > 2) {
+        GifBatchScanner scanner;
+        if (argc > 3) {
+            scanner.threads = std::atol(argv[3]);
+        }
+        auto files = collectBatchFiles(argv[2], {".gif"});
+        auto start = std::chrono::steady_clock::now();
+        scanner.run(files, stdout);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::fflush(stdout);
+        std::cerr << files.size() << " files (" << scanner.errors
+                  << " with errors), " << scanner.bytes << " bytes in "
+                  << seconds << " s, " << files.size() / std::max(seconds, 1e-9)
+                  << " files/s on " << scanner.threads << " threads"
+                  << std::endl;
+        return 0;
+    }
+    if (option == "--bench") {
+        // --bench [gif file] [--json results.json]
+        const char *file = nullptr;
+        const char *json = nullptr;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--json" && i + 1 < argc) {
+                json = argv[++i];
+            } else {
+                file = argv[i];
+            }
+        }
+        return bench(file, json);
+    }
+    if (option == "--check-stream") {
+        // the streaming decoder's peak RSS must not grow with the frame
+        // count; `make check` runs this
+        return benchStream("synthetic 320x240 key/10",
+                           makeSyntheticGif(320, 240, 50, 3, 10))
+                   ? 0
+                   : 1;
+    }
+
+    if (option == "--push" && argc > 2) {
+        int fd = ::open(argv[2], O_RDONLY);
+        if (fd < 0) {
+            std::cout << "file is not exists: " << argv[2] << std::endl;
+            return -1;
+        }
+        PushPreview preview;
+        GifPushParser parser(preview);
+        preview.parser = &parser;
+        uint8_t chunk[4096];
+        ssize_t n;
+        while ((n = ::read(fd, chunk, sizeof(chunk))) > 0 &&
+               parser.feed(chunk, n)) {
+            countRead(n);
+        }
+        close(fd);
+        if (!parser.done()) {
+            std::cout << "incomplete or invalid gif after " << parser.consumed
+                      << " bytes" << std::endl;
+            return -1;
+        }
+        std::cout << "frame counts: " << parser.frameCount << std::endl;
+        return 0;
+    }
+
+    if (option == "--stream" && argc > 2) {
+        // "-" decodes standard input
+        bool stdinInput = std::string(argv[2]) == "-";
+        ByteSource source;
+        if (!stdinInput && !source.open(argv[2])) {
+            std::cout << "file is not exists: " << argv[2] << std::endl;
+            return -1;
+        }
+        StreamingDecoder decoder;
+        size_t frames = 0;
+        auto count = [&frames](size_t, const Compositor &) { ++frames; };
+        bool complete = stdinInput ? decoder.run(0, count)
+                                   : decoder.run(source, count);
+        rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+        std::cout << "frame counts: " << frames << ", peak RSS "
+                  << usage.ru_maxrss << " KiB" << std::endl;
+        if (!complete) {
+            std::cout << "incomplete or invalid gif" << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (option == "--thumbnail" && argc > 3) {
+        auto start = std::chrono::steady_clock::now();
+        ByteSource mapped;
+        if (!mapped.open(argv[3], ByteSource::Backend::Mapped)) {
+            std::cout << "file is not exists: " << argv[3] << std::endl;
+            return -1;
+        }
+        Thumbnail thumbnail;
+        if (!thumbnail.build(mapped.data(), mapped.size(),
+                             std::atol(argv[2]))) {
+            std::cout << "no frame in " << argv[3] << std::endl;
+            return -1;
+        }
+        auto end = std::chrono::steady_clock::now();
+        uint32_t hash = 2166136261u; // FNV-1a over the thumbnail
+        for (uint32_t pixel : thumbnail.pixels) {
+            hash = (hash ^ pixel) * 16777619u;
+        }
+        std::cout << "thumbnail " << thumbnail.width << "x" << thumbnail.height
+                  << " in "
+                  << std::chrono::duration<double>(end - start).count() * 1e3
+                  << " ms, checksum=" << std::hex << std::showbase << hash
+                  << std::endl;
+        if (argc > 4 && !thumbnail.save(argv[4])) {
+            std::cout << "cannot write " << argv[4] << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (option == "--encode" && argc > 3) {
+        // re-encodes frames [first, last] of a GIF, scaled so that the
+        // longer side is at most `max size`: previews and trimmed clips
+        ByteSource mapped;
+        GifFrameIndex index;
+        if (!mapped.open(argv[2], ByteSource::Backend::Mapped) ||
+            !index.build(mapped.data(), mapped.size())) {
+            std::cout << "it is not a gif file: " << argv[2] << std::endl;
+            return -1;
+        }
+        const auto &screen = index.logicScreen.logicalScreenDescriptor;
+        size_t screenWidth = std::max<size_t>(screen.logicalScreenWidth, 1);
+        size_t screenHeight = std::max<size_t>(screen.logicalScreenHeight, 1);
+        size_t longer = std::max(screenWidth, screenHeight);
+        size_t maxSize = argc > 4 ? std::atol(argv[4]) : longer;
+        maxSize = std::max<size_t>(std::min(maxSize, longer), 1);
+        size_t width = std::max<size_t>(screenWidth * maxSize / longer, 1);
+        size_t height = std::max<size_t>(screenHeight * maxSize / longer, 1);
+        size_t first = argc > 5 ? std::atol(argv[5]) : 0;
+        size_t last = argc > 6 ? std::atol(argv[6]) : SIZE_MAX;
+        last = std::min(last, index.frames.size() - 1);
+        if (index.frames.empty() || first > last) {
+            std::cout << "no frames to encode in " << argv[2] << std::endl;
+            return -1;
+        }
+
+        FILE *out = std::fopen(argv[3], "wb");
+        if (!out) {
+            std::cout << "cannot write " << argv[3] << std::endl;
+            return -1;
+        }
+        GifEncoder encoder;
+        encoder.begin(width, height);
+        bool ok = true;
+        auto drain = [&] {
+            ok = ok && std::fwrite(encoder.out.data(), 1, encoder.out.size(),
+                                   out) == encoder.out.size();
+            encoder.out.clear();
+        };
+        // frames are decoded here in order and encoded in batches, one
+        // frame or more per thread
+        std::vector<GifEncoder::Frame> batch;
+        double decodeSeconds = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = first; i <= last; ++i) {
+            auto decodeStart = std::chrono::steady_clock::now();
+            const auto *canvas = index.seekFrame(i);
+            GifEncoder::Frame frame;
+            frame.pixels = width == screenWidth && height == screenHeight
+                               ? *canvas
+                               : downscale(*canvas, screenWidth, screenHeight,
+                                           width, height);
+            frame.delayTime = index.frames[i].delayTime;
+            batch.push_back(std::move(frame));
+            decodeSeconds += std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - decodeStart)
+                                 .count();
+            if (batch.size() >= encoder.threads * 2 || i == last) {
+                encoder.addFrames(std::move(batch));
+                batch.clear();
+                drain();
+            }
+        }
+        encoder.finish();
+        drain();
+        ok = std::fclose(out) == 0 && ok;
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        if (!ok) {
+            std::cout << "cannot write " << argv[3] << std::endl;
+            return -1;
+        }
+        double encodeSeconds = std::max(seconds - decodeSeconds, 1e-9);
+        std::cout << "encoded " << encoder.frameCount << " frames at "
+                  << width << "x" << height << " on " << encoder.threads
+                  << " threads in " << seconds << " s (decode "
+                  << decodeSeconds << " s), "
+                  << encoder.frameCount * width * height / encodeSeconds / 1e6
+                  << " Mpixels/s" << std::endl;
+        return 0;
+    }
+
+    int fileArg = 1;
+    long seekTo = -1;
+    if ((option == "--index" || option == "--decode" ||
+         option == "--delays") &&
+        argc > 2) {
+        fileArg = 2;
+    } else if (option == "--frame" && argc > 3) {
+        seekTo = std::atol(argv[2]);
+        fileArg = 3;
+    }
+
+    std::string file(argv[fileArg]);
+
+    // The index paths decode frames on several threads straight from the
+    // bytes, so they map the file; the walks read it front to back through
+    // the io_uring readahead.
+    bool randomAccess = fileArg > 1 && option != "--delays";
+    ByteSource source;
+
+    if (!source.open(file, randomAccess ? ByteSource::Backend::Mapped
+                                        : ByteSource::Backend::Auto)) {
+        std::cout << "file is not exists: " << file << std::endl;
+        return -1;
+    }
+
+    ByteCursor input(source);
+
+    if (input.peek() != 'G') {
+        std::cout << "it is not a gif file: " << file << std::endl;
+        return -1;
+    }
+
+    if (randomAccess) {
+        GifFrameIndex index;
+        if (!useCache ||
+            !GifIndexCache::load(file, source.data(), source.size(), index)) {
+            if (!index.build(source.data(), source.size())) {
+                std::cout << "it is not a gif file: " << file << std::endl;
+                return -1;
+            }
+            if (useCache) {
+                GifIndexCache::save(file, index);
+            }
+        }
+        if (option == "--index") {
+            for (const auto &entry : index.frames) {
+                std::cout << entry << std::endl;
+            }
+            std::cout << "frame counts: " << index.frames.size() << std::endl;
+            return 0;
+        }
+        if (option == "--decode") {
+            ParallelDecoder decoder;
+            Compositor compositor;
+            size_t dirtyArea = 0;
+            auto start = std::chrono::steady_clock::now();
+            decoder.run(index, compositor,
+                        [&dirtyArea](size_t, const Compositor &c) {
+                            dirtyArea += c.dirty.area();
+                        });
+            auto end = std::chrono::steady_clock::now();
+            size_t canvasArea = std::max<size_t>(
+                compositor.width * compositor.height * index.frames.size(), 1);
+            std::cout << "decoded " << index.frames.size() << " frames on "
+                      << decoder.threads << " threads in "
+                      << std::chrono::duration<double>(end - start).count()
+                      << " s, dirty area " << 100.0 * dirtyArea / canvasArea
+                      << "% of canvas" << std::endl;
+            return 0;
+        }
+        const auto *canvas = index.seekFrame(seekTo);
+        if (!canvas) {
+            std::cout << "no frame " << seekTo << " in " << file << std::endl;
+            return -1;
+        }
+        uint32_t hash = 2166136261u; // FNV-1a over the canvas
+        for (uint32_t pixel : *canvas) {
+            hash = (hash ^ pixel) * 16777619u;
+        }
+        std::cout << "frame " << seekTo
+                  << ": keyframe=" << index.frames[seekTo].keyframe
+                  << ", canvas=" << index.compositor.width << "x"
+                  << index.compositor.height << ", checksum=" << std::hex
+                  << std::showbase << hash << std::endl;
+        return 0;
+    }
+
+    if (option == "--delays") {
+        // only Graphic Control Extensions are parsed; images are hopped over
+        struct DelayPrinter : GifVisitor {
+            size_t frames = 0;
+            DelayPrinter() { interests = GraphicControlExtensions; }
+            void onGraphicControlExtension(
+                const GraphicControlExtension &control) override {
+                std::cout << "frame " << frames++ << ": delayTime="
+                          << control.delayTime << std::endl;
+            }
+        } delays;
+        walkGif(input, delays);
+        return 0;
+    }
+
+    GifPrinter printer(std::cout);
+    walkGif(input, printer);
 
-    std::cout << "frame counts: " << gif.graphicBlocks.size() << std::endl;
+    std::cout << "frame counts: " << printer.frames << std::endl;
 
     return 0;
 }
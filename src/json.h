@@ -0,0 +1,29 @@
+// JSON output shared by --batch, --bench and --stats in both tools.
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Set by the Makefile from `git describe`; reported in every JSON record.
+#ifndef PARSER_VERSION
+#define PARSER_VERSION "unknown"
+#endif
+
+// Appends `s` as a JSON string literal.
+inline void appendJson(std::string &out, std::string_view s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    out += '"';
+}
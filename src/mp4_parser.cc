@@ -1,31 +1,100 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <span>
+#include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <variant>
 #include <vector>
 
+#include "arena.h"
+#include "batch.h"
+#include "bench.h"
+#include "byte_source.h"
+#include "json.h"
+#include "parse_stats.h"
+#include "source_key.h"
+
 inline uint32_t swap_endian(uint32_t a) {
     return ((a & 0xff000000) >> 24) | ((a & 0x00ff0000) >> 8) |
            ((a & 0xff00) << 8) | ((a & 0xff) << 24);
 }
 
+inline uint64_t swap_endian(uint64_t a) {
+    return static_cast<uint64_t>(swap_endian(static_cast<uint32_t>(a))) << 32 |
+           swap_endian(static_cast<uint32_t>(a >> 32));
+}
+
+// 盒子类型：四个字符按大端拼成的整数。从字符串字面量构造只能在编译期
+// 完成，所以type == "moov"这样的比较就是一次整数比较
+struct FourCC {
+    uint32_t value = 0;
+
+    constexpr FourCC() = default;
+    constexpr explicit FourCC(uint32_t value) : value(value) {}
+    consteval FourCC(const char (&s)[5])
+        : value(uint32_t(uint8_t(s[0])) << 24 | uint32_t(uint8_t(s[1])) << 16 |
+                uint32_t(uint8_t(s[2])) << 8 | uint8_t(s[3])) {}
+
+    constexpr bool operator==(const FourCC &) const = default;
+
+    std::string str() const {
+        return {char(value >> 24), char(value >> 16), char(value >> 8),
+                char(value)};
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, FourCC type) {
+    os << type.str();
+    return os;
+}
+
 struct BoxHeader {
-    uint32_t size;
-    std::string type;
-    std::string parent_type;
-    int beginPosition;
-    int endPosition;
-    BoxHeader(std::istream &input, std::string parent) : parent_type(parent) {
-        beginPosition = static_cast<int>(input.tellg()) + 1;
+    uint64_t size;       // 整个盒子的大小，0表示延伸到父盒子(或文件)末尾
+    uint32_t headerSize; // 8，带64位largesize时为16
+    FourCC type;
+    FourCC parent_type;
+    uint64_t beginPosition;
+    uint64_t endPosition;
+    BoxHeader(std::istream &input, FourCC parent) : parent_type(parent) {
+        beginPosition = static_cast<uint64_t>(input.tellg()) + 1;
 
-        input.read(reinterpret_cast<char *>(&size), sizeof(size));
-        size = swap_endian(size);
+        uint32_t size32 = 0;
+        input.read(reinterpret_cast<char *>(&size32), sizeof(size32));
+        size = swap_endian(size32);
+        headerSize = 8;
 
-        char ctype[5] = {0, 0, 0, 0, 0};
-        input.read(ctype, sizeof(ctype) - 1);
-        type = std::string(ctype);
+        uint32_t type32 = 0;
+        input.read(reinterpret_cast<char *>(&type32), sizeof(type32));
+        type = FourCC(swap_endian(type32));
 
-        endPosition = input.tellg();
+        if (size == 1) { // 真正的大小在后面的largesize里
+            input.read(reinterpret_cast<char *>(&size), sizeof(size));
+            size = swap_endian(size);
+            headerSize = 16;
+        }
+
+        endPosition = beginPosition - 1 + headerSize;
     }
 };
 
@@ -40,32 +109,686 @@ std::ostream &operator<<(std::ostream &os, const BoxHeader &b) {
     return os;
 }
 
+// 这些是纯容器，不包含字段的
+inline bool isContainer(FourCC type) {
+    switch (type.value) {
+    case FourCC("moov").value:
+    case FourCC("trak").value:
+    case FourCC("mdia").value:
+    case FourCC("minf").value:
+    case FourCC("stbl").value:
+    case FourCC("udta").value:
+    case FourCC("edts").value:
+    case FourCC("mvex").value:
+    case FourCC("moof").value:
+    case FourCC("traf").value:
+    case FourCC("mfra").value:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 盒子事件回调，walkBoxes按文件顺序分发
+struct BoxVisitor {
+    virtual ~BoxVisitor() = default;
+    // input停在载荷开头，回调可以读取载荷；返回false则不进入该容器
+    virtual bool enterBox(const BoxHeader &header, std::istream &input,
+                          int depth) {
+        return true;
+    }
+    virtual void leaveBox(const BoxHeader &header, int depth) {}
+    virtual void onError(const BoxHeader &header) {}
+};
+
+// 以ByteSource为底的istream缓冲区。get区就是已经读进内存的那一段文件，
+// 窗口内的seekg/tellg只是移动指针，不再有系统调用；读到窗口外才等待
+// ByteSource把对应的块读进来
+struct SourceStreamBuf : std::streambuf {
+    ByteSource &source;
+
+    explicit SourceStreamBuf(ByteSource &source) : source(source) { reset(); }
+
+    void reset() {
+        char *p = at(0);
+        setg(p, p, p);
+    }
+
+    // 提示[offset, offset + n)马上要读，先把读请求发出去
+    void will_need(uint64_t offset, size_t n) { source.willNeed(offset, n); }
+
+  protected:
+    int_type underflow() override {
+        uint64_t position = gptr() - at(0);
+        uint64_t end = source.ensure(position, 1);
+        if (position >= source.size() || end <= position) {
+            return traits_type::eof();
+        }
+        // [eback, gptr)已经在内存里，窗口接着往后长
+        setg(eback(), gptr(), at(end));
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char *out, std::streamsize n) override {
+        uint64_t position = gptr() - at(0);
+        uint64_t available = source.size() - std::min(position, source.size());
+        uint64_t count = std::min<uint64_t>(n, available);
+        if (gptr() + count > egptr()) {
+            uint64_t end = source.ensure(position, count);
+            count = std::min(count, end - std::min(end, position));
+            setg(eback(), gptr(), std::max(egptr(), at(end)));
+        }
+        std::memcpy(out, gptr(), count);
+        setg(eback(), gptr() + count, egptr());
+        return count;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override {
+        off_type base = dir == std::ios_base::beg   ? 0
+                        : dir == std::ios_base::cur ? gptr() - at(0)
+                                                    : source.size();
+        return seekpos(base + off, which);
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode) override {
+        off_type offset = position;
+        if (offset < 0 || static_cast<uint64_t>(offset) > source.size()) {
+            return pos_type(off_type(-1));
+        }
+        char *p = at(offset);
+        if (p >= eback() && p <= egptr()) {
+            setg(eback(), p, egptr());
+        } else {
+            setg(p, p, p); // 窗口外，下次读的时候再等
+            if (statsEnabled()) {
+                ++parseStats().seeks;
+            }
+        }
+        return position;
+    }
+
+  private:
+    char *at(uint64_t offset) const {
+        return const_cast<char *>(
+            reinterpret_cast<const char *>(source.data())) + offset;
+    }
+};
+
+// 从文件读盒子用的istream：MP4的块小一些，预读也只多读一块，
+// 其余靠walkBoxes在每个盒子头上提示下一个盒子的位置
+struct SourceStream : std::istream {
+    ByteSource source;
+    SourceStreamBuf buffer;
+
+    SourceStream() : std::istream(nullptr), buffer(source) {
+        source.blockSize = 64 << 10;
+        source.readahead = 1;
+    }
+
+    explicit SourceStream(const std::string &path) : SourceStream() {
+        open(path);
+    }
+
+    bool open(const std::string &path) {
+        if (!source.open(path)) {
+            setstate(std::ios::failbit);
+            return false;
+        }
+        buffer.reset();
+        rdbuf(&buffer);
+        clear();
+        return true;
+    }
+
+    void close() {
+        source.close();
+        buffer.reset();
+    }
+};
+
+// 容器嵌套的上限。正常文件不过十来层，再深的是构造出来耗尽栈的输入
+constexpr int maxBoxDepth = 128;
+
+// 遍历input当前位置到end(不含)之间的盒子，载荷用seekg跳过，不读取；
+// 嵌套超过maxBoxDepth层的盒子按坏盒子报错
+inline bool walkBoxes(std::istream &input, BoxVisitor &visitor,
+                      FourCC parent, uint64_t end,
+                      int depth = 0) {
+    auto *source = dynamic_cast<SourceStreamBuf *>(input.rdbuf());
+    while (true) {
+        uint64_t offset = static_cast<uint64_t>(input.tellg());
+        if (offset >= end) {
+            break;
+        }
+        char type[4];
+        StructureScope scope; // --stats：连同子盒子一起计时
+        BoxHeader header(input, parent);
+        if (header.size == 0 && input) {
+            header.size = end - offset;
+        }
+        if (!input || header.size < header.headerSize ||
+            header.size > end - offset || depth >= maxBoxDepth) {
+            visitor.onError(header);
+            return false;
+        }
+        uint64_t boxEnd = offset + header.size;
+        if (scope.active()) {
+            uint32_t be = swap_endian(header.type.value);
+            std::memcpy(type, &be, sizeof(type));
+            scope.key = header.type.value;
+            scope.name = {type, sizeof(type)};
+            scope.bytes = header.size;
+        }
+        if (source && boxEnd < end) {
+            // 下一个盒子头往往在跳过的载荷后面很远，先把它读起来
+            source->will_need(boxEnd, 16);
+        }
+
+        if (visitor.enterBox(header, input, depth) &&
+            isContainer(header.type)) {
+            input.clear();
+            input.seekg(header.endPosition);
+            if (!walkBoxes(input, visitor, header.type, boxEnd, depth + 1))
+                return false;
+        }
+
+        // 跳过回调没有读完的载荷
+        input.clear();
+        input.seekg(boxEnd);
+        visitor.leaveBox(header, depth);
+    }
+    return true;
+}
+
+// 遍历整个文件
+inline bool walkBoxes(std::istream &input, BoxVisitor &visitor) {
+    input.seekg(0, std::ios::end);
+    uint64_t end = static_cast<uint64_t>(input.tellg());
+    input.seekg(0);
+    return walkBoxes(input, visitor, "root", end);
+}
+
+inline uint32_t read_be32(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+           p[3];
+}
+
+inline uint64_t read_be64(const uint8_t *p) {
+    return uint64_t(read_be32(p)) << 32 | read_be32(p + 4);
+}
+
+// 读取盒子剩下的载荷，一次read
+inline std::vector<uint8_t> read_payload(std::istream &input,
+                                         const BoxHeader &header) {
+    std::vector<uint8_t> payload(header.size - header.headerSize);
+    input.read(reinterpret_cast<char *>(payload.data()), payload.size());
+    payload.resize(input.gcount());
+    return payload;
+}
+
+// 同上，载荷分配在resource里
+inline std::pmr::vector<uint8_t>
+read_payload(std::istream &input, const BoxHeader &header,
+             std::pmr::memory_resource *resource) {
+    std::pmr::vector<uint8_t> payload(header.size - header.headerSize,
+                                      resource);
+    input.read(reinterpret_cast<char *>(payload.data()), payload.size());
+    payload.resize(input.gcount());
+    return payload;
+}
+
+// full box的载荷以1字节version和3字节flags开头
+struct FullBoxHeader {
+    uint8_t version = 0;
+    uint32_t flags = 0;
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (size < 4) {
+            return false;
+        }
+        version = p[0];
+        flags = read_be32(p) & 0xFFFFFF;
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const FullBoxHeader &h) {
+    os << "version=" << +h.version << ", flags=0x" << std::hex << h.flags
+       << std::dec;
+    return os;
+}
+
+// 下面是解出字段的盒子。每个都有编译期的type、从载荷解码的parse，以及
+// 打印字段的operator<<；载荷太短时parse返回false。带容器的盒子用pmr容器，
+// 构造时可以给一个分配器，解进盒子树时就分配在树的arena里
+
+struct FileTypeBox {
+    static constexpr FourCC type = "ftyp";
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    FourCC major_brand;
+    uint32_t minor_version = 0;
+    std::pmr::vector<FourCC> compatible_brands;
+
+    explicit FileTypeBox(allocator_type allocator = {})
+        : compatible_brands(allocator) {}
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (size < 8) {
+            return false;
+        }
+        major_brand = FourCC(read_be32(p));
+        minor_version = read_be32(p + 4);
+        for (size_t at = 8; at + 4 <= size; at += 4) {
+            compatible_brands.push_back(FourCC(read_be32(p + at)));
+        }
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const FileTypeBox &b) {
+    os << "FileTypeBox("
+       << "major_brand=" << b.major_brand        //
+       << ", minor_version=" << b.minor_version //
+       << ", compatible_brands=[";
+    for (size_t i = 0; i < b.compatible_brands.size(); ++i) {
+        os << (i ? "," : "") << b.compatible_brands[i];
+    }
+    os << "])";
+    return os;
+}
+
+struct MovieHeaderBox {
+    static constexpr FourCC type = "mvhd";
+    FullBoxHeader full;
+    uint64_t creation_time = 0;
+    uint64_t modification_time = 0;
+    uint32_t timescale = 0;
+    uint64_t duration = 0;
+    double rate = 0;   // 16.16定点数
+    double volume = 0; // 8.8定点数
+    uint32_t next_track_id = 0;
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size)) {
+            return false;
+        }
+        // version 1的时间和时长是64位
+        size_t wide = full.version == 1 ? 12 : 0;
+        if (size < 100 + wide) {
+            return false;
+        }
+        if (full.version == 1) {
+            creation_time = read_be64(p + 4);
+            modification_time = read_be64(p + 12);
+            timescale = read_be32(p + 20);
+            duration = read_be64(p + 24);
+        } else {
+            creation_time = read_be32(p + 4);
+            modification_time = read_be32(p + 8);
+            timescale = read_be32(p + 12);
+            duration = read_be32(p + 16);
+        }
+        rate = int32_t(read_be32(p + 20 + wide)) / 65536.0;
+        volume = int16_t(read_be32(p + 24 + wide) >> 16) / 256.0;
+        next_track_id = read_be32(p + 96 + wide);
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const MovieHeaderBox &b) {
+    os << "MovieHeaderBox("                             //
+       << b.full                                        //
+       << ", creation_time=" << b.creation_time         //
+       << ", modification_time=" << b.modification_time //
+       << ", timescale=" << b.timescale                 //
+       << ", duration=" << b.duration                   //
+       << ", rate=" << b.rate                           //
+       << ", volume=" << b.volume                       //
+       << ", next_track_id=" << b.next_track_id         //
+       << ")";
+    return os;
+}
+
+struct TrackHeaderBox {
+    static constexpr FourCC type = "tkhd";
+    FullBoxHeader full;
+    uint64_t creation_time = 0;
+    uint64_t modification_time = 0;
+    uint32_t track_id = 0;
+    uint64_t duration = 0;
+    int16_t layer = 0;
+    int16_t alternate_group = 0;
+    double volume = 0;
+    double width = 0; // 16.16定点数
+    double height = 0;
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size)) {
+            return false;
+        }
+        size_t wide = full.version == 1 ? 12 : 0;
+        if (size < 84 + wide) {
+            return false;
+        }
+        if (full.version == 1) {
+            creation_time = read_be64(p + 4);
+            modification_time = read_be64(p + 12);
+            track_id = read_be32(p + 20);
+            duration = read_be64(p + 28);
+        } else {
+            creation_time = read_be32(p + 4);
+            modification_time = read_be32(p + 8);
+            track_id = read_be32(p + 12);
+            duration = read_be32(p + 20);
+        }
+        const uint8_t *q = p + 24 + wide; // reserved之后
+        layer = int16_t(read_be32(q + 8) >> 16);
+        alternate_group = int16_t(read_be32(q + 8));
+        volume = int16_t(read_be32(q + 12) >> 16) / 256.0;
+        width = read_be32(q + 52) / 65536.0;
+        height = read_be32(q + 56) / 65536.0;
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const TrackHeaderBox &b) {
+    os << "TrackHeaderBox("                         //
+       << b.full                                    //
+       << ", track_id=" << b.track_id               //
+       << ", duration=" << b.duration               //
+       << ", layer=" << b.layer                     //
+       << ", alternate_group=" << b.alternate_group //
+       << ", volume=" << b.volume                   //
+       << ", width=" << b.width                     //
+       << ", height=" << b.height                   //
+       << ")";
+    return os;
+}
+
+struct MediaHeaderBox {
+    static constexpr FourCC type = "mdhd";
+    FullBoxHeader full;
+    uint64_t creation_time = 0;
+    uint64_t modification_time = 0;
+    uint32_t timescale = 0;
+    uint64_t duration = 0;
+    char language[4] = {}; // ISO 639-2，每个字母5位
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size)) {
+            return false;
+        }
+        size_t wide = full.version == 1 ? 12 : 0;
+        if (size < 20 + wide) {
+            return false;
+        }
+        if (full.version == 1) {
+            creation_time = read_be64(p + 4);
+            modification_time = read_be64(p + 12);
+            timescale = read_be32(p + 20);
+            duration = read_be64(p + 24);
+        } else {
+            creation_time = read_be32(p + 4);
+            modification_time = read_be32(p + 8);
+            timescale = read_be32(p + 12);
+            duration = read_be32(p + 16);
+        }
+        if (size >= 22 + wide) {
+            uint16_t packed = p[20 + wide] << 8 | p[21 + wide];
+            for (int i = 0; i < 3; ++i) {
+                language[i] = 0x60 + (packed >> (10 - 5 * i) & 0x1F);
+            }
+        }
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const MediaHeaderBox &b) {
+    os << "MediaHeaderBox("             //
+       << b.full                        //
+       << ", timescale=" << b.timescale //
+       << ", duration=" << b.duration   //
+       << ", language=" << b.language   //
+       << ")";
+    return os;
+}
+
+struct HandlerBox {
+    static constexpr FourCC type = "hdlr";
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    FullBoxHeader full;
+    FourCC handler_type;
+    std::pmr::string name;
+
+    explicit HandlerBox(allocator_type allocator = {}) : name(allocator) {}
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size) || size < 12) {
+            return false;
+        }
+        handler_type = FourCC(read_be32(p + 8));
+        if (size > 24) { // 以NUL结尾的UTF-8名字
+            const char *s = reinterpret_cast<const char *>(p + 24);
+            name.assign(s, strnlen(s, size - 24));
+        }
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const HandlerBox &b) {
+    os << "HandlerBox("                       //
+       << b.full                              //
+       << ", handler_type=" << b.handler_type //
+       << ", name=" << b.name                 //
+       << ")";
+    return os;
+}
+
+struct SampleDescriptionBox {
+    struct Entry {
+        FourCC format;
+        uint32_t size = 0;
+        uint16_t data_reference_index = 0;
+        uint16_t width = 0; // 视频
+        uint16_t height = 0;
+        uint16_t channel_count = 0; // 音频
+        uint16_t sample_size = 0;
+        uint32_t sample_rate = 0;
+    };
+
+    static constexpr FourCC type = "stsd";
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    FullBoxHeader full;
+    std::pmr::vector<Entry> entries;
+
+    explicit SampleDescriptionBox(allocator_type allocator = {})
+        : entries(allocator) {}
+
+    static bool is_visual(FourCC format) {
+        return format == "avc1" || format == "avc3" || format == "hvc1" ||
+               format == "hev1" || format == "mp4v" || format == "av01" ||
+               format == "vp08" || format == "vp09" || format == "encv";
+    }
+    static bool is_audio(FourCC format) {
+        return format == "mp4a" || format == "ac-3" || format == "ec-3" ||
+               format == "Opus" || format == "fLaC" || format == "alac" ||
+               format == "enca";
+    }
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size) || size < 8) {
+            return false;
+        }
+        uint32_t count = read_be32(p + 4);
+        for (size_t at = 8; entries.size() < count && at + 16 <= size;) {
+            Entry entry;
+            entry.size = read_be32(p + at);
+            if (entry.size < 16 || at + entry.size > size) {
+                break;
+            }
+            entry.format = FourCC(read_be32(p + at + 4));
+            const uint8_t *q = p + at + 8; // SampleEntry的6字节reserved之后
+            entry.data_reference_index = q[6] << 8 | q[7];
+            if (is_visual(entry.format) && entry.size >= 8 + 8 + 28) {
+                entry.width = q[24] << 8 | q[25];
+                entry.height = q[26] << 8 | q[27];
+            } else if (is_audio(entry.format) && entry.size >= 8 + 8 + 28) {
+                entry.channel_count = q[16] << 8 | q[17];
+                entry.sample_size = q[18] << 8 | q[19];
+                entry.sample_rate = read_be32(q + 24) >> 16;
+            }
+            entries.push_back(entry);
+            at += entry.size;
+        }
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const SampleDescriptionBox &b) {
+    os << "SampleDescriptionBox(" << b.full << ", entries=[";
+    for (size_t i = 0; i < b.entries.size(); ++i) {
+        const auto &e = b.entries[i];
+        os << (i ? ", " : "") << e.format << "(size=" << e.size
+           << ", data_reference_index=" << e.data_reference_index;
+        if (e.width || e.height) {
+            os << ", width=" << e.width << ", height=" << e.height;
+        }
+        if (e.channel_count) {
+            os << ", channel_count=" << e.channel_count
+               << ", sample_size=" << e.sample_size
+               << ", sample_rate=" << e.sample_rate;
+        }
+        os << ")";
+    }
+    os << "])";
+    return os;
+}
+
+struct EditListBox {
+    struct Entry {
+        uint64_t segment_duration;
+        int64_t media_time; // -1表示空编辑
+        int16_t media_rate_integer;
+        int16_t media_rate_fraction;
+    };
+
+    static constexpr FourCC type = "elst";
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    FullBoxHeader full;
+    std::pmr::vector<Entry> entries;
+
+    explicit EditListBox(allocator_type allocator = {}) : entries(allocator) {}
+
+    bool parse(const uint8_t *p, size_t size) {
+        if (!full.parse(p, size) || size < 8) {
+            return false;
+        }
+        size_t entry_size = full.version == 1 ? 20 : 12;
+        size_t count =
+            std::min<size_t>(read_be32(p + 4), (size - 8) / entry_size);
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t *q = p + 8 + i * entry_size;
+            Entry entry;
+            if (full.version == 1) {
+                entry.segment_duration = read_be64(q);
+                entry.media_time = int64_t(read_be64(q + 8));
+                q += 16;
+            } else {
+                entry.segment_duration = read_be32(q);
+                entry.media_time = int32_t(read_be32(q + 4));
+                q += 8;
+            }
+            entry.media_rate_integer = int16_t(read_be32(q) >> 16);
+            entry.media_rate_fraction = int16_t(read_be32(q));
+            entries.push_back(entry);
+        }
+        return true;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const EditListBox &b) {
+    os << "EditListBox(" << b.full << ", entries=[";
+    for (size_t i = 0; i < b.entries.size(); ++i) {
+        const auto &e = b.entries[i];
+        os << (i ? ", " : "") << "(segment_duration=" << e.segment_duration
+           << ", media_time=" << e.media_time
+           << ", media_rate=" << e.media_rate_integer << ")";
+    }
+    os << "])";
+    return os;
+}
+
+// 编译期的解码器表：按type分发到对应的盒子类型，结果放进Fields。
+// 没有登记的类型只有盒子头
+template <typename... Boxes> struct BoxDecoderRegistry {
+    using Fields = std::variant<std::monostate, Boxes...>;
+
+    static constexpr bool has(FourCC type) {
+        return ((type == Boxes::type) || ...);
+    }
+
+    // 带容器的字段分配在resource里
+    static Fields decode(FourCC type, const uint8_t *p, size_t size,
+                         std::pmr::memory_resource *resource =
+                             std::pmr::get_default_resource()) {
+        std::pmr::polymorphic_allocator<> allocator(resource);
+        Fields fields;
+        auto decode_as = [&](auto box) {
+            if (type != decltype(box)::type) {
+                return false;
+            }
+            if (box.parse(p, size)) {
+                fields = std::move(box);
+            }
+            return true;
+        };
+        (decode_as(std::make_obj_using_allocator<Boxes>(allocator)) || ...);
+        return fields;
+    }
+
+    // 各个type不能重复
+    static constexpr bool unique() {
+        FourCC types[] = {Boxes::type...};
+        for (size_t i = 0; i < sizeof...(Boxes); ++i) {
+            for (size_t j = i + 1; j < sizeof...(Boxes); ++j) {
+                if (types[i] == types[j]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+using BoxDecoders =
+    BoxDecoderRegistry<FileTypeBox, MovieHeaderBox, TrackHeaderBox,
+                       MediaHeaderBox, HandlerBox, SampleDescriptionBox,
+                       EditListBox>;
+static_assert(BoxDecoders::unique());
+
+// 盒子树的节点。子盒子串成单链表，节点和字段都分配在树的arena里，
+// 不拥有彼此，整棵树随arena一次释放
 struct Box {
     BoxHeader header;
-    int beginPosition;
-    int endPosition;
-    std::vector<std::unique_ptr<Box>> sub_boxes;
+    uint64_t beginPosition;
+    uint64_t endPosition;
+    BoxDecoders::Fields fields; // 登记过的类型解出的字段
+    Box *first_child = nullptr;
+    Box *next_sibling = nullptr;
     Box(BoxHeader h) : header(h) {
-        beginPosition = h.beginPosition;
-        endPosition = h.endPosition;
-    }
-
-    Box(BoxHeader h, std::istream &input) : Box(h) {
         beginPosition = h.beginPosition;
         endPosition = beginPosition + h.size - 1;
+    }
 
-        // 这些是纯容器，不包含字段的
-        if (h.type == "moov" || h.type == "trak"                        //
-            || h.type == "mdia" || h.type == "minf" || h.type == "stbl" //
-            || h.type == "udta" || h.type == "edts") {
-            while (input.good() && endPosition - beginPosition < h.size) {
-                BoxHeader boxHeader(input, h.type);
-                auto box = std::make_unique<Box>(boxHeader, input);
-                sub_boxes.push_back(std::move(box));
-                input.peek(); // triggered ios state check
-            }
-        } else {
-            input.ignore(h.size - 8);
+    // 登记过解码器的类型读出载荷解码，input要停在载荷开头；
+    // 载荷和字段都分配在resource里
+    void decode(std::istream &input, std::pmr::memory_resource *resource =
+                                         std::pmr::get_default_resource()) {
+        if (BoxDecoders::has(header.type)) {
+            auto payload = read_payload(input, header, resource);
+            fields = BoxDecoders::decode(header.type, payload.data(),
+                                         payload.size(), resource);
         }
     }
 };
@@ -74,36 +797,2747 @@ std::ostream &operator<<(std::ostream &os, const Box &b) {
 
     os << "Box("                                                           //
        << b.header                                                         //
-       << ", position=[" << b.beginPosition << "," << b.endPosition << "]" //
-       << ")" << std::endl;
-    for (const auto &s : b.sub_boxes) {
+       << ", position=[" << b.beginPosition << "," << b.endPosition << "]";
+    std::visit(
+        [&os](const auto &fields) {
+            if constexpr (!std::is_same_v<decltype(fields),
+                                          const std::monostate &>) {
+                os << ", " << fields;
+            }
+        },
+        b.fields);
+    os << ")" << std::endl;
+    for (const Box *s = b.first_child; s; s = s->next_sibling) {
         os << *s;
     }
     return os;
 }
 
-int main(int argc, char *argv[]) {
+// 把事件还原成盒子树。整棵树都在arena里，没有逐个节点的释放；
+// 盒子的析构也不需要调用，arena释放时一起回收
+struct BoxTreeBuilder : BoxVisitor {
+    Arena arena;
+    Box *first = nullptr; // 第一个顶层盒子，其余的是它的兄弟
+    // 每层下一个盒子要挂到的位置
+    std::pmr::vector<Box **> tails{{&first}, &arena};
 
-    if (argc <= 1) {
-        std::cout << "Usage: mp4_parser <mp4 file>" << std::endl;
-        return 0;
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        Box *box = arena.make<Box>(header);
+        box->decode(input, &arena);
+        *tails.back() = box;
+        tails.back() = &box->next_sibling;
+        tails.push_back(&box->first_child);
+        return true;
+    }
+    void leaveBox(const BoxHeader &header, int depth) override {
+        tails.pop_back();
     }
+};
 
-    std::string file(argv[1]);
+// 边遍历边打印，不保留盒子树
+struct BoxPrinter : BoxVisitor {
+    std::ostream &os;
+    Arena arena; // 每个盒子打印完就清空
+    BoxPrinter(std::ostream &os) : os(os) {}
 
-    std::ifstream input(file, std::ios::binary);
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        {
+            Box box(header);
+            box.decode(input, &arena);
+            os << box;
+        }
+        arena.release();
+        return true;
+    }
+    void onError(const BoxHeader &header) override {
+        os << "Error: bad box " << header << " at " << header.beginPosition
+           << std::endl;
+    }
+};
 
-    if (!input) {
-        std::cout << "file is not exists: " << file << std::endl;
-        return -1;
+// 只关心stsz的订阅者：跳过其它分支，只读取每个轨道的采样数
+struct SampleCountReader : BoxVisitor {
+    std::ostream &os;
+    int tracks = 0;
+    SampleCountReader(std::ostream &os) : os(os) {}
+
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        if (header.type == "stsz") {
+            uint32_t fields[3] = {0, 0, 0}; // version/flags, size, count
+            // 载荷不够12字节，或者文件在这里截断，就不读后面盒子的字节
+            if (header.size - header.headerSize < sizeof(fields) ||
+                !input.read(reinterpret_cast<char *>(fields),
+                            sizeof(fields))) {
+                os << "track " << tracks++ << ": Error: bad box " << header
+                   << " at " << header.beginPosition << std::endl;
+                return false;
+            }
+            os << "track " << tracks++
+               << ": sample_size=" << swap_endian(fields[1])
+               << ", sample_count=" << swap_endian(fields[2]) << std::endl;
+            return false;
+        }
+        return header.type == "moov" || header.type == "trak" ||
+               header.type == "mdia" || header.type == "minf" ||
+               header.type == "stbl";
+    }
+};
+
+
+// 一个轨道的采样索引，按列存放：采样大小、文件偏移、解码时间戳、
+// 合成时间偏移和同步采样位图。时间都以轨道的timescale为单位
+struct SampleIndex {
+    uint32_t track_id = 0;
+    std::string handler;
+    uint32_t timescale = 0;
+    uint64_t duration = 0;
+    std::string codec;       // 第一个样本描述的类型，如avc1、hvc1
+    uint16_t width = 0;      // 第一个样本描述里的视频尺寸
+    uint16_t height = 0;
+    int nal_length_size = 0; // avcC/hvcC里NAL长度字段的字节数
+    std::vector<std::string> parameter_sets; // VPS/SPS/PPS，按出现顺序
+
+    // 解析出来的列放在storage里；从缓存打开时各列直接指向mapping，
+    // storage为空
+    struct Columns {
+        std::vector<uint32_t> sizes;
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> dts;
+        std::vector<int32_t> cts_offsets;
+        std::vector<uint64_t> sync_bits;
+    } storage;
+    std::shared_ptr<const void> mapping;
+
+    std::span<const uint32_t> sizes;
+    std::span<const uint64_t> offsets;
+    std::span<const uint64_t> dts;
+    std::span<const int32_t> cts_offsets; // 没有ctts时为空
+    std::span<const uint64_t> sync_bits;  // 没有stss时为空，表示全是同步采样
+    uint64_t next_dts = 0; // 下一个采样的解码时间，分片追加时接着用
+
+    SampleIndex() = default;
+    SampleIndex(SampleIndex &&) = default;
+    SampleIndex &operator=(SampleIndex &&) = default;
+    SampleIndex(const SampleIndex &other) { *this = other; }
+    SampleIndex &operator=(const SampleIndex &other) {
+        track_id = other.track_id;
+        handler = other.handler;
+        timescale = other.timescale;
+        duration = other.duration;
+        codec = other.codec;
+        width = other.width;
+        height = other.height;
+        nal_length_size = other.nal_length_size;
+        parameter_sets = other.parameter_sets;
+        storage = other.storage;
+        mapping = other.mapping;
+        sizes = other.sizes;
+        offsets = other.offsets;
+        dts = other.dts;
+        cts_offsets = other.cts_offsets;
+        sync_bits = other.sync_bits;
+        next_dts = other.next_dts;
+        if (!mapping) {
+            attach();
+        }
+        return *this;
+    }
+
+    // 让各列指向storage，storage改动之后都要调用
+    void attach() {
+        sizes = storage.sizes;
+        offsets = storage.offsets;
+        dts = storage.dts;
+        cts_offsets = storage.cts_offsets;
+        sync_bits = storage.sync_bits;
+    }
+
+    // 映射的列是只读的，要改之前先复制到storage
+    void detach() {
+        if (!mapping) {
+            return;
+        }
+        storage.sizes.assign(sizes.begin(), sizes.end());
+        storage.offsets.assign(offsets.begin(), offsets.end());
+        storage.dts.assign(dts.begin(), dts.end());
+        storage.cts_offsets.assign(cts_offsets.begin(), cts_offsets.end());
+        storage.sync_bits.assign(sync_bits.begin(), sync_bits.end());
+        mapping.reset();
+        attach();
     }
 
-    while (input.good()) {
-        BoxHeader boxHeader(input, "root");
-        Box box(boxHeader, input);
-        std::cout << box;
-        input.peek(); // triggered ios state check
+    size_t sample_count() const { return sizes.size(); }
+
+    // 分片里的采样逐个追加到各列末尾，已有的部分不动。第一次出现合成
+    // 偏移或非同步采样时才补上对应的列
+    void append(uint32_t size, uint64_t offset, uint32_t duration,
+                int32_t cts, bool sync) {
+        detach();
+        Columns &c = storage;
+        size_t n = c.sizes.size();
+        if (cts != 0 || !c.cts_offsets.empty()) {
+            c.cts_offsets.resize(n, 0);
+            c.cts_offsets.push_back(cts);
+        }
+        if (!sync || !c.sync_bits.empty()) {
+            if (c.sync_bits.empty()) { // 之前的采样都是同步采样
+                c.sync_bits.assign((n + 63) / 64, ~uint64_t(0));
+                if (n % 64) {
+                    c.sync_bits.back() = ~uint64_t(0) >> (64 - n % 64);
+                }
+            }
+            if (c.sync_bits.size() * 64 <= n) {
+                c.sync_bits.push_back(0);
+            }
+            c.sync_bits[n / 64] |= uint64_t(sync) << (n % 64);
+        }
+        c.sizes.push_back(size);
+        c.offsets.push_back(offset);
+        c.dts.push_back(next_dts);
+        next_dts += duration;
+        attach();
+    }
+
+    bool is_sync(size_t sample) const {
+        return sync_bits.empty() ||
+               (sync_bits[sample / 64] >> (sample % 64) & 1);
+    }
+
+    int32_t cts_offset(size_t sample) const {
+        return cts_offsets.empty() ? 0 : cts_offsets[sample];
+    }
+
+    // 解码时间覆盖t的采样，t早于第一个采样时返回SIZE_MAX
+    size_t sample_at_time(uint64_t t) const {
+        auto it = std::upper_bound(dts.begin(), dts.end(), t);
+        if (it == dts.begin()) {
+            return SIZE_MAX;
+        }
+        return it - dts.begin() - 1;
+    }
+
+    // t处或之前最近的同步采样，没有时返回SIZE_MAX
+    size_t nearest_keyframe_before(uint64_t t) const {
+        size_t sample = sample_at_time(t);
+        if (sample == SIZE_MAX || sync_bits.empty()) {
+            return sample;
+        }
+        // 在位图里往回找，每次看64个采样
+        size_t word = sample / 64;
+        uint64_t bits = sync_bits[word] & (~uint64_t(0) >> (63 - sample % 64));
+        while (bits == 0) {
+            if (word == 0) {
+                return SIZE_MAX;
+            }
+            bits = sync_bits[--word];
+        }
+        return word * 64 + 63 - __builtin_clzll(bits);
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const SampleIndex &s) {
+    size_t keyframes = 0;
+    for (size_t i = 0; i < s.sample_count(); ++i) {
+        keyframes += s.is_sync(i);
     }
+    os << "SampleIndex("
+       << "track_id=" << s.track_id         //
+       << ", handler=" << s.handler         //
+       << ", codec=" << s.codec             //
+       << ", timescale=" << s.timescale     //
+       << ", duration=" << s.duration       //
+       << ", samples=" << s.sample_count()  //
+       << ", keyframes=" << keyframes       //
+       << ", ctts=" << !s.cts_offsets.empty() //
+       << ")";
+    return os;
+}
+
+// sidx：一段媒体按引用切成的子段，offset是引用的绝对文件偏移
+struct SegmentIndex {
+    struct Reference {
+        bool is_sidx; // 引用的是下一级sidx而不是媒体
+        uint32_t size;
+        uint32_t duration;
+        bool starts_with_sap;
+        uint64_t offset;
+    };
+    uint32_t reference_id = 0;
+    uint32_t timescale = 0;
+    uint64_t earliest_presentation_time = 0;
+    std::vector<Reference> references;
+};
+
+std::ostream &operator<<(std::ostream &os, const SegmentIndex &s) {
+    os << "SegmentIndex("
+       << "reference_id=" << s.reference_id                             //
+       << ", timescale=" << s.timescale                                 //
+       << ", earliest_presentation_time=" << s.earliest_presentation_time //
+       << ", references=" << s.references.size()                        //
+       << ")";
+    return os;
+}
+
+// 解码moov里每个trak的stbl，生成SampleIndex。只进入通往这些表的容器，
+// 每张表一次读入，trak结束时把stsc/stco/stts展开成按采样的列。分片文件
+// 里每个moof的trun直接追加到对应轨道的末尾，之前的分片不会再解析
+struct SampleTableReader : BoxVisitor {
+    std::vector<SampleIndex> tracks;
+    std::vector<SegmentIndex> segment_indexes;
+    size_t fragments = 0;
+    uint64_t position = 0; // update()下次从这个顶层盒子开始
+
+    // mvex/trex里每个轨道的分片默认值
+    struct TrackExtends {
+        uint32_t track_id;
+        uint32_t duration;
+        uint32_t size;
+        uint32_t flags;
+    };
+    std::vector<TrackExtends> extends;
+
+    // 当前moof/traf的状态
+    uint64_t moof_offset = 0;
+    uint64_t data_end = 0; // 上一个trun的数据末尾
+    SampleIndex *traf_track = nullptr;
+    TrackExtends traf_defaults = {};
+
+    // 当前trak里展开前的表
+    std::vector<uint64_t> chunk_offsets;
+    std::vector<uint32_t> stsc; // first_chunk, samples_per_chunk 交替存放
+    std::vector<uint32_t> stts; // sample_count, sample_delta 交替存放
+    std::vector<uint32_t> ctts; // sample_count, sample_offset 交替存放
+    std::vector<uint32_t> stss; // 同步采样的序号，从1开始
+    bool has_stss = false;
+
+    // 文件大小，限制表里声明的采样数：采样数据都在文件里，按每个采样至少
+    // 1字节算。第一次用到时才量；update()时文件在变长，每次重新量
+    uint64_t source_size = 0;
+
+    uint64_t measure(std::istream &input) {
+        if (source_size == 0) {
+            std::streampos here = input.tellg();
+            input.seekg(0, std::ios::end);
+            source_size = static_cast<uint64_t>(input.tellg());
+            input.clear();
+            input.seekg(here);
+        }
+        return source_size;
+    }
+
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        FourCC type = header.type;
+        if (type == "stsz" || type == "trun") {
+            measure(input);
+        }
+        if (type == "trak") {
+            tracks.emplace_back();
+            chunk_offsets.clear();
+            stsc.clear();
+            stts.clear();
+            ctts.clear();
+            stss.clear();
+            has_stss = false;
+            return true;
+        }
+        if (type == "moov" || type == "mdia" || type == "minf" ||
+            type == "stbl" || type == "mvex" || type == "traf") {
+            traf_track = nullptr;
+            return true;
+        }
+        if (type == "moof") {
+            moof_offset = header.beginPosition - 1;
+            data_end = moof_offset;
+            ++fragments;
+            return true;
+        }
+        if (type == "trex" || type == "tfhd" || type == "tfdt" ||
+            type == "trun" || type == "sidx") {
+            std::vector<uint8_t> payload = read_payload(input, header);
+            enterFragmentBox(header, payload.data(), payload.size());
+            return false;
+        }
+        if (tracks.empty() ||
+            !(type == "tkhd" || type == "mdhd" || type == "hdlr" ||
+              type == "stsz" || type == "stz2" || type == "stco" ||
+              type == "co64" || type == "stsc" || type == "stts" ||
+              type == "ctts" || type == "stss" || type == "stsd")) {
+            return false;
+        }
+
+        std::vector<uint8_t> payload = read_payload(input, header);
+        const uint8_t *p = payload.data();
+        size_t size = payload.size();
+        if (size < 8) {
+            return false;
+        }
+        SampleIndex &track = tracks.back();
+        // 大多数表是：version/flags，entry_count，然后是定长的表项
+        auto entries = [&](size_t offset, size_t entry_size) -> size_t {
+            if (size < offset) {
+                return 0;
+            }
+            return std::min<size_t>(read_be32(p + offset - 4),
+                                    (size - offset) / entry_size);
+        };
+
+        if (type == TrackHeaderBox::type) {
+            TrackHeaderBox tkhd;
+            if (tkhd.parse(p, size)) {
+                track.track_id = tkhd.track_id;
+            }
+        } else if (type == MediaHeaderBox::type) {
+            MediaHeaderBox mdhd;
+            if (mdhd.parse(p, size)) {
+                track.timescale = mdhd.timescale;
+                track.duration = mdhd.duration;
+            }
+        } else if (type == HandlerBox::type) {
+            HandlerBox hdlr;
+            if (hdlr.parse(p, size)) {
+                track.handler = hdlr.handler_type.str();
+            }
+        } else if (type == "stsd" && size >= 16) {
+            // 只看第一个样本描述；视频的固定字段有78字节，后面是子盒子
+            size_t end = std::min<size_t>(8 + read_be32(p + 8), size);
+            track.codec.assign(reinterpret_cast<const char *>(p + 12), 4);
+            SampleDescriptionBox stsd;
+            if (stsd.parse(p, size) && !stsd.entries.empty()) {
+                track.width = stsd.entries[0].width;
+                track.height = stsd.entries[0].height;
+            }
+            for (size_t at = 16 + 78; at + 8 <= end;) {
+                uint32_t child = read_be32(p + at);
+                if (child < 8 || at + child > end) {
+                    break;
+                }
+                if (std::memcmp(p + at + 4, "avcC", 4) == 0) {
+                    parse_avcc(track, p + at + 8, child - 8);
+                } else if (std::memcmp(p + at + 4, "hvcC", 4) == 0) {
+                    parse_hvcc(track, p + at + 8, child - 8);
+                }
+                at += child;
+            }
+        } else if (type == "stsz" && size >= 12) {
+            uint32_t sample_size = read_be32(p + 4);
+            uint32_t count = read_be32(p + 8);
+            if (sample_size != 0) {
+                track.storage.sizes.assign(
+                    std::min<uint64_t>(count, source_size / sample_size),
+                    sample_size);
+            } else {
+                size_t n = entries(12, 4);
+                track.storage.sizes.resize(n);
+                for (size_t i = 0; i < n; ++i) {
+                    track.storage.sizes[i] = read_be32(p + 12 + 4 * i);
+                }
+            }
+        } else if (type == "stz2" && size >= 12) {
+            uint8_t field_size = p[7];
+            size_t count = read_be32(p + 8);
+            size_t bits = (size - 12) * 8;
+            if (field_size == 4 || field_size == 8 || field_size == 16) {
+                count = std::min(count, bits / field_size);
+                track.storage.sizes.resize(count);
+                const uint8_t *q = p + 12;
+                for (size_t i = 0; i < count; ++i) {
+                    if (field_size == 4) {
+                        track.storage.sizes[i] = i % 2 ? q[i / 2] & 0x0F : q[i / 2] >> 4;
+                    } else if (field_size == 8) {
+                        track.storage.sizes[i] = q[i];
+                    } else {
+                        track.storage.sizes[i] = q[2 * i] << 8 | q[2 * i + 1];
+                    }
+                }
+            }
+        } else if (type == "stco") {
+            size_t n = entries(8, 4);
+            chunk_offsets.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                chunk_offsets[i] = read_be32(p + 8 + 4 * i);
+            }
+        } else if (type == "co64") {
+            size_t n = entries(8, 8);
+            chunk_offsets.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                chunk_offsets[i] = read_be64(p + 8 + 8 * i);
+            }
+        } else if (type == "stsc") {
+            size_t n = entries(8, 12);
+            stsc.resize(2 * n);
+            for (size_t i = 0; i < n; ++i) {
+                stsc[2 * i] = read_be32(p + 8 + 12 * i);
+                stsc[2 * i + 1] = read_be32(p + 12 + 12 * i);
+            }
+        } else if (type == "stts" || type == "ctts") {
+            std::vector<uint32_t> &table = type == "stts" ? stts : ctts;
+            size_t n = entries(8, 8);
+            table.resize(2 * n);
+            for (size_t i = 0; i < 2 * n; ++i) {
+                table[i] = read_be32(p + 8 + 4 * i);
+            }
+        } else if (type == "stss") {
+            size_t n = entries(8, 4);
+            stss.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                stss[i] = read_be32(p + 8 + 4 * i);
+            }
+            has_stss = true;
+        }
+        return false;
+    }
+
+    // AVCDecoderConfigurationRecord：SPS和PPS各一组，长度前缀2字节
+    static void parse_avcc(SampleIndex &track, const uint8_t *p, size_t size) {
+        if (size < 6) {
+            return;
+        }
+        track.nal_length_size = (p[4] & 3) + 1;
+        size_t at = 5;
+        for (int group = 0; group < 2 && at < size; ++group) {
+            int count = group == 0 ? p[at] & 0x1F : p[at];
+            ++at;
+            for (int i = 0; i < count && at + 2 <= size; ++i) {
+                size_t length = p[at] << 8 | p[at + 1];
+                if (at + 2 + length > size) {
+                    return;
+                }
+                track.parameter_sets.emplace_back(
+                    reinterpret_cast<const char *>(p + at + 2), length);
+                at += 2 + length;
+            }
+        }
+    }
+
+    // HEVCDecoderConfigurationRecord：22字节的头之后是按NAL类型分组的数组
+    static void parse_hvcc(SampleIndex &track, const uint8_t *p, size_t size) {
+        if (size < 23) {
+            return;
+        }
+        track.nal_length_size = (p[21] & 3) + 1;
+        size_t arrays = p[22];
+        size_t at = 23;
+        for (size_t a = 0; a < arrays && at + 3 <= size; ++a) {
+            size_t count = p[at + 1] << 8 | p[at + 2];
+            at += 3;
+            for (size_t i = 0; i < count && at + 2 <= size; ++i) {
+                size_t length = p[at] << 8 | p[at + 1];
+                if (at + 2 + length > size) {
+                    return;
+                }
+                track.parameter_sets.emplace_back(
+                    reinterpret_cast<const char *>(p + at + 2), length);
+                at += 2 + length;
+            }
+        }
+    }
+
+    SampleIndex *find_track(uint32_t track_id) {
+        for (auto &track : tracks) {
+            if (track.track_id == track_id) {
+                return &track;
+            }
+        }
+        return nullptr;
+    }
+
+    void enterFragmentBox(const BoxHeader &header, const uint8_t *p,
+                          size_t size) {
+        FourCC type = header.type;
+        if (size < 8) {
+            return;
+        }
+        uint8_t version = p[0];
+        uint32_t flags = read_be32(p) & 0xFFFFFF;
+
+        if (type == "trex" && size >= 24) {
+            extends.push_back({read_be32(p + 4), read_be32(p + 12),
+                               read_be32(p + 16), read_be32(p + 20)});
+        } else if (type == "tfhd") {
+            uint32_t track_id = read_be32(p + 4);
+            traf_track = find_track(track_id);
+            traf_defaults = {track_id, 0, 0, 0};
+            for (const auto &e : extends) {
+                if (e.track_id == track_id) {
+                    traf_defaults = e;
+                }
+            }
+            // 可选字段按flags的顺序排列
+            size_t at = 8;
+            auto field = [&](uint32_t flag, size_t bytes) -> uint64_t {
+                if (!(flags & flag) || at + bytes > size) {
+                    return 0;
+                }
+                uint64_t v = bytes == 8 ? read_be64(p + at) : read_be32(p + at);
+                at += bytes;
+                return v;
+            };
+            uint64_t base = field(0x000001, 8);
+            field(0x000002, 4); // sample_description_index
+            if (flags & 0x000008) {
+                traf_defaults.duration = field(0x000008, 4);
+            }
+            if (flags & 0x000010) {
+                traf_defaults.size = field(0x000010, 4);
+            }
+            if (flags & 0x000020) {
+                traf_defaults.flags = field(0x000020, 4);
+            }
+            // 没有base_data_offset时：default-base-is-moof从moof开始算，
+            // 否则接着上一个traf的数据
+            if (flags & 0x000001) {
+                data_end = base;
+            } else if (flags & 0x020000) {
+                data_end = moof_offset;
+            }
+        } else if (type == "tfdt" && traf_track) {
+            traf_track->next_dts =
+                version == 1 && size >= 12 ? read_be64(p + 4) : read_be32(p + 4);
+        } else if (type == "trun" && traf_track) {
+            uint32_t count = read_be32(p + 4);
+            size_t at = 8;
+            uint64_t offset = data_end;
+            if ((flags & 0x000001) && at + 4 <= size) {
+                offset = data_end + static_cast<int32_t>(read_be32(p + at));
+                at += 4;
+            }
+            uint32_t first_flags = traf_defaults.flags;
+            bool has_first_flags = false;
+            if ((flags & 0x000004) && at + 4 <= size) {
+                first_flags = read_be32(p + at);
+                has_first_flags = true;
+                at += 4;
+            }
+            size_t entry = 4 * (!!(flags & 0x100) + !!(flags & 0x200) +
+                                !!(flags & 0x400) + !!(flags & 0x800));
+            count = std::min<size_t>(count, entry > 0 ? (size - at) / entry
+                                                      : size_t(1) << 24);
+            // 没有逐个采样的字段时，数量只受文件大小限制：同一轨道累计
+            // 不超过文件字节数，定长采样还要放得进offset之后的部分
+            size_t held = traf_track->sample_count();
+            count = std::min<uint64_t>(
+                count, source_size > held ? source_size - held : 0);
+            if (!(flags & 0x200) && traf_defaults.size > 0) {
+                count = std::min<uint64_t>(
+                    count, (source_size - std::min(offset, source_size)) /
+                               traf_defaults.size);
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t duration = traf_defaults.duration;
+                uint32_t sample_size = traf_defaults.size;
+                uint32_t sample_flags = i == 0 && has_first_flags
+                                            ? first_flags
+                                            : traf_defaults.flags;
+                int32_t cts = 0;
+                if (flags & 0x100) {
+                    duration = read_be32(p + at);
+                    at += 4;
+                }
+                if (flags & 0x200) {
+                    sample_size = read_be32(p + at);
+                    at += 4;
+                }
+                if (flags & 0x400) {
+                    uint32_t f = read_be32(p + at);
+                    at += 4;
+                    if (!(i == 0 && has_first_flags)) {
+                        sample_flags = f;
+                    }
+                }
+                if (flags & 0x800) {
+                    cts = static_cast<int32_t>(read_be32(p + at));
+                    at += 4;
+                }
+                // sample_is_non_sync_sample
+                bool sync = !(sample_flags & 0x00010000);
+                traf_track->append(sample_size, offset, duration, cts, sync);
+                offset += sample_size;
+            }
+            data_end = offset;
+        } else if (type == "sidx" && size >= 12) {
+            SegmentIndex index;
+            index.reference_id = read_be32(p + 4);
+            index.timescale = read_be32(p + 8);
+            size_t at = 12;
+            uint64_t first_offset = 0;
+            if (version == 0 && size >= 20) {
+                index.earliest_presentation_time = read_be32(p + 12);
+                first_offset = read_be32(p + 16);
+                at = 20;
+            } else if (version != 0 && size >= 28) {
+                index.earliest_presentation_time = read_be64(p + 12);
+                first_offset = read_be64(p + 20);
+                at = 28;
+            } else {
+                return;
+            }
+            if (at + 4 > size) {
+                return;
+            }
+            size_t count = std::min<size_t>(read_be32(p + at) & 0xFFFF,
+                                            (size - at - 4) / 12);
+            at += 4;
+            // 引用从sidx之后的first_offset处开始，一个接一个
+            uint64_t offset = header.beginPosition - 1 + header.size +
+                              first_offset;
+            for (size_t i = 0; i < count; ++i, at += 12) {
+                uint32_t word = read_be32(p + at);
+                SegmentIndex::Reference reference;
+                reference.is_sidx = word >> 31;
+                reference.size = word & 0x7FFFFFFF;
+                reference.duration = read_be32(p + at + 4);
+                reference.starts_with_sap = p[at + 8] >> 7;
+                reference.offset = offset;
+                offset += reference.size;
+                index.references.push_back(reference);
+            }
+            segment_indexes.push_back(std::move(index));
+        }
+    }
+
+    // 处理input里新到的完整顶层盒子，返回处理了几个。直播时文件不断变长，
+    // 每次只从上次停下的位置往后解析，没写完的盒子留到下一次
+    size_t update(std::istream &input) {
+        input.clear();
+        input.seekg(0, std::ios::end);
+        uint64_t end = static_cast<uint64_t>(input.tellg());
+        source_size = end;
+        size_t boxes = 0;
+        while (position + 8 <= end) {
+            input.seekg(position);
+            BoxHeader header(input, "root");
+            // size为0的盒子会随着文件一起变长，等它写完也没有意义
+            if (!input || header.size < header.headerSize ||
+                position + header.size > end) {
+                break;
+            }
+            input.clear();
+            input.seekg(position);
+            walkBoxes(input, *this, "root", position + header.size);
+            position += header.size;
+            ++boxes;
+        }
+        return boxes;
+    }
+
+    void leaveBox(const BoxHeader &header, int depth) override {
+        if (header.type == "trak") {
+            finish(tracks.back());
+        }
+    }
+
+    // 把stsc/stco和stts展开成每个采样的偏移和时间戳
+    void finish(SampleIndex &track) {
+        size_t count = track.storage.sizes.size();
+
+        track.storage.offsets.assign(count, 0);
+        size_t sample = 0;
+        for (size_t e = 0; e < stsc.size() / 2 && sample < count; ++e) {
+            size_t first = std::max<uint32_t>(stsc[2 * e], 1) - 1;
+            size_t last = e + 1 < stsc.size() / 2
+                              ? std::max<uint32_t>(stsc[2 * e + 2], 1) - 1
+                              : chunk_offsets.size();
+            last = std::min(last, chunk_offsets.size());
+            uint32_t per_chunk = stsc[2 * e + 1];
+            for (size_t chunk = first; chunk < last && sample < count;
+                 ++chunk) {
+                uint64_t offset = chunk_offsets[chunk];
+                for (uint32_t i = 0; i < per_chunk && sample < count; ++i) {
+                    track.storage.offsets[sample] = offset;
+                    offset += track.storage.sizes[sample++];
+                }
+            }
+        }
+
+        track.storage.dts.assign(count, 0);
+        uint64_t time = 0;
+        sample = 0;
+        for (size_t e = 0; e < stts.size() / 2 && sample < count; ++e) {
+            for (uint32_t i = 0; i < stts[2 * e] && sample < count; ++i) {
+                track.storage.dts[sample++] = time;
+                time += stts[2 * e + 1];
+            }
+        }
+        for (; sample < count; ++sample) { // stts比采样短
+            track.storage.dts[sample] = time;
+        }
+        track.next_dts = time;
+
+        // ctts的偏移按32位有符号数读，version 0里超过2^31的值并不实际存在
+        track.storage.cts_offsets.clear();
+        if (!ctts.empty()) {
+            track.storage.cts_offsets.assign(count, 0);
+            sample = 0;
+            for (size_t e = 0; e < ctts.size() / 2 && sample < count; ++e) {
+                for (uint32_t i = 0; i < ctts[2 * e] && sample < count; ++i) {
+                    track.storage.cts_offsets[sample++] =
+                        static_cast<int32_t>(ctts[2 * e + 1]);
+                }
+            }
+        }
+
+        // 有stss但为空表示没有同步采样
+        track.storage.sync_bits.clear();
+        if (has_stss) {
+            auto &sync_bits = track.storage.sync_bits;
+            sync_bits.assign(std::max<size_t>((count + 63) / 64, 1), 0);
+            for (uint32_t number : stss) {
+                if (number >= 1 && number <= count) {
+                    sync_bits[(number - 1) / 64] |= uint64_t(1)
+                                                    << ((number - 1) % 64);
+                }
+            }
+        }
+
+        track.attach();
+
+        chunk_offsets = {};
+        stsc = {};
+        stts = {};
+        ctts = {};
+        stss = {};
+    }
+};
+
+// 文件里的一段字节，[offset, offset + size)
+struct ByteRange {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t end() const { return offset + size; }
+};
+
+std::ostream &operator<<(std::ostream &os, const ByteRange &r) {
+    os << "ByteRange(offset=" << r.offset << ", size=" << r.size << ")";
+    return os;
+}
+
+// 把时间窗口[t0, t1)(秒)换算成要读的字节范围。每个轨道从t0处或之前最近
+// 的同步采样开始，到解码时间不早于t1的第一个采样为止；所有采样的字节
+// 按文件偏移排序合并，间隔不超过max_gap的相邻范围也合成一个，多读一点
+// 间隙换更少的请求。结果按偏移升序且互不重叠
+inline std::vector<ByteRange>
+plan_byte_ranges(const std::vector<const SampleIndex *> &tracks, double t0,
+                 double t1, uint64_t max_gap) {
+    // 先在每个轨道内按解码顺序合并：交织的文件里同一轨道的采样大多挨着
+    // 或只隔着别的轨道的一个块，这样排序的只是块而不是采样
+    std::vector<ByteRange> runs;
+    for (const SampleIndex *track : tracks) {
+        if (track->timescale == 0 || track->sample_count() == 0 || t1 <= t0) {
+            continue;
+        }
+        uint64_t start_time =
+            static_cast<uint64_t>(std::max(t0, 0.0) * track->timescale);
+        uint64_t end_time =
+            static_cast<uint64_t>(std::max(t1, 0.0) * track->timescale);
+        // 窗口开头之前没有同步采样时从第一个采样开始
+        size_t first = track->nearest_keyframe_before(start_time);
+        if (first == SIZE_MAX) {
+            first = 0;
+        }
+        size_t last = std::lower_bound(track->dts.begin(), track->dts.end(),
+                                       end_time) -
+                      track->dts.begin();
+        for (size_t s = first; s < last; ++s) {
+            uint64_t offset = track->offsets[s];
+            uint64_t size = track->sizes[s];
+            if (!runs.empty() && offset >= runs.back().offset &&
+                offset <= runs.back().end() + max_gap) {
+                runs.back().size =
+                    std::max(runs.back().end(), offset + size) -
+                    runs.back().offset;
+            } else {
+                runs.push_back({offset, size});
+            }
+        }
+    }
+
+    std::sort(runs.begin(), runs.end(),
+              [](const ByteRange &a, const ByteRange &b) {
+                  return a.offset < b.offset;
+              });
+    std::vector<ByteRange> ranges;
+    for (const ByteRange &run : runs) {
+        if (!ranges.empty() && run.offset <= ranges.back().end() + max_gap) {
+            ranges.back().size =
+                std::max(ranges.back().end(), run.end()) - ranges.back().offset;
+        } else {
+            ranges.push_back(run);
+        }
+    }
+    return ranges;
+}
+
+// SampleTableReader结果的磁盘缓存，放在"<文件>.idx"。头部记下源文件，
+// 后面是每个轨道的记录和按内存布局原样写出的各列，每段64字节对齐。
+// 打开时映射整个缓存，校验头部后让各列直接指向映射，不做反序列化；
+// 源文件变了、版本或结构布局不同都当作没有缓存，重新解析后覆盖
+struct SampleIndexCache {
+    static constexpr char magic[8] = {'M', 'P', '4', 'I', 'D', 'X', 0, 1};
+    static constexpr uint32_t version = 2;
+
+    struct TrackRecord {
+        uint32_t track_id;
+        uint32_t timescale;
+        uint32_t width;
+        uint32_t height;
+        uint64_t duration;
+        uint64_t next_dts;
+        int32_t nal_length_size;
+        uint32_t parameter_set_count;
+        uint64_t strings; // handler、codec和参数集，各带4字节长度
+        uint64_t strings_size;
+        uint64_t sample_count;
+        uint64_t cts_count;
+        uint64_t sync_count;
+        uint64_t sizes;
+        uint64_t offsets;
+        uint64_t dts;
+        uint64_t cts_offsets;
+        uint64_t sync_bits;
+    };
+
+    struct SegmentRecord {
+        uint32_t reference_id;
+        uint32_t timescale;
+        uint64_t earliest_presentation_time;
+        uint64_t reference_count;
+        uint64_t references;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t layout; // 记录结构的大小，编译出的布局变了就失效
+        SourceKey source;
+        uint64_t path_length;
+        uint64_t fragments;
+        uint64_t track_count;
+        uint64_t tracks;
+        uint64_t segment_count;
+        uint64_t segments;
+    };
+
+    static uint32_t layout() {
+        return sizeof(TrackRecord) << 20 | sizeof(SegmentRecord) << 10 |
+               sizeof(SegmentIndex::Reference);
+    }
+
+    static std::string path_for(const std::string &file) {
+        return file + ".idx";
+    }
+
+    // 从缓存填充reader，缓存不存在或失效时返回false
+    static bool load(const std::string &file, SampleTableReader &reader) {
+        SourceKey source;
+        if (!source.read(file)) {
+            return false;
+        }
+        int fd = ::open(path_for(file).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        size_t map_size = st.st_size;
+        std::shared_ptr<const void> mapping(map, [map_size](const void *p) {
+            munmap(const_cast<void *>(p), map_size);
+        });
+        const char *base = static_cast<const char *>(map);
+
+        // [offset, offset + count * size)整个落在缓存里，起点按alignment
+        // 对齐，否则不能当作T的数组用
+        auto fits = [map_size](uint64_t offset, uint64_t count, size_t size,
+                               size_t alignment) {
+            return offset <= map_size && offset % alignment == 0 &&
+                   count <= (map_size - offset) / size;
+        };
+        const auto *header = reinterpret_cast<const Header *>(base);
+        if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+            header->version != version || header->layout != layout() ||
+            !(header->source == source) ||
+            header->path_length != file.size() ||
+            !fits(sizeof(Header), file.size(), 1, 1) ||
+            std::memcmp(base + sizeof(Header), file.data(), file.size()) != 0 ||
+            !fits(header->tracks, header->track_count, sizeof(TrackRecord),
+                  alignof(TrackRecord)) ||
+            !fits(header->segments, header->segment_count,
+                  sizeof(SegmentRecord), alignof(SegmentRecord))) {
+            return false;
+        }
+
+        std::vector<SampleIndex> tracks(header->track_count);
+        const auto *records =
+            reinterpret_cast<const TrackRecord *>(base + header->tracks);
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            const TrackRecord &r = records[i];
+            SampleIndex &track = tracks[i];
+            if (!fits(r.strings, r.strings_size, 1, 1) ||
+                !fits(r.sizes, r.sample_count, sizeof(uint32_t),
+                      alignof(uint32_t)) ||
+                !fits(r.offsets, r.sample_count, sizeof(uint64_t),
+                      alignof(uint64_t)) ||
+                !fits(r.dts, r.sample_count, sizeof(uint64_t),
+                      alignof(uint64_t)) ||
+                !fits(r.cts_offsets, r.cts_count, sizeof(int32_t),
+                      alignof(int32_t)) ||
+                !fits(r.sync_bits, r.sync_count, sizeof(uint64_t),
+                      alignof(uint64_t))) {
+                return false;
+            }
+            const char *p = base + r.strings;
+            const char *end = p + r.strings_size;
+            auto next_string = [&p, end](std::string &s) {
+                uint32_t n;
+                if (end - p < 4 || (std::memcpy(&n, p, 4), end - p - 4 < n)) {
+                    return false;
+                }
+                s.assign(p + 4, n);
+                p += 4 + n;
+                return true;
+            };
+            track.parameter_sets.resize(
+                std::min<uint64_t>(r.parameter_set_count, r.strings_size / 4));
+            if (!next_string(track.handler) || !next_string(track.codec)) {
+                return false;
+            }
+            for (auto &parameter_set : track.parameter_sets) {
+                if (!next_string(parameter_set)) {
+                    return false;
+                }
+            }
+            track.track_id = r.track_id;
+            track.timescale = r.timescale;
+            track.width = r.width;
+            track.height = r.height;
+            track.duration = r.duration;
+            track.next_dts = r.next_dts;
+            track.nal_length_size = r.nal_length_size;
+            track.sizes = {reinterpret_cast<const uint32_t *>(base + r.sizes),
+                           r.sample_count};
+            track.offsets = {
+                reinterpret_cast<const uint64_t *>(base + r.offsets),
+                r.sample_count};
+            track.dts = {reinterpret_cast<const uint64_t *>(base + r.dts),
+                         r.sample_count};
+            track.cts_offsets = {
+                reinterpret_cast<const int32_t *>(base + r.cts_offsets),
+                r.cts_count};
+            track.sync_bits = {
+                reinterpret_cast<const uint64_t *>(base + r.sync_bits),
+                r.sync_count};
+            track.mapping = mapping;
+        }
+
+        std::vector<SegmentIndex> segment_indexes(header->segment_count);
+        const auto *segments =
+            reinterpret_cast<const SegmentRecord *>(base + header->segments);
+        for (size_t i = 0; i < segment_indexes.size(); ++i) {
+            const SegmentRecord &r = segments[i];
+            if (!fits(r.references, r.reference_count,
+                      sizeof(SegmentIndex::Reference),
+                      alignof(SegmentIndex::Reference))) {
+                return false;
+            }
+            const auto *references =
+                reinterpret_cast<const SegmentIndex::Reference *>(
+                    base + r.references);
+            segment_indexes[i].reference_id = r.reference_id;
+            segment_indexes[i].timescale = r.timescale;
+            segment_indexes[i].earliest_presentation_time =
+                r.earliest_presentation_time;
+            segment_indexes[i].references.assign(
+                references, references + r.reference_count);
+        }
+
+        reader.tracks = std::move(tracks);
+        reader.segment_indexes = std::move(segment_indexes);
+        reader.fragments = header->fragments;
+        reader.position = source.size;
+        return true;
+    }
+
+    // 先写临时文件再改名，读的一方不会看到写了一半的缓存。目录不可写时
+    // 返回false
+    static bool save(const std::string &file, const SampleTableReader &reader) {
+        std::string image(sizeof(Header), '\0');
+        // 追加一段，返回它64字节对齐的起点
+        auto put = [&image](const void *data, size_t size) -> uint64_t {
+            image.resize((image.size() + 63) / 64 * 64);
+            uint64_t offset = image.size();
+            image.append(static_cast<const char *>(data), size);
+            return offset;
+        };
+
+        Header header = {};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.layout = layout();
+        if (!header.source.read(file)) {
+            return false;
+        }
+        header.path_length = file.size();
+        header.fragments = reader.fragments;
+        image.append(file);
+
+        std::vector<TrackRecord> records;
+        for (const auto &track : reader.tracks) {
+            TrackRecord r = {};
+            r.track_id = track.track_id;
+            r.timescale = track.timescale;
+            r.width = track.width;
+            r.height = track.height;
+            r.duration = track.duration;
+            r.next_dts = track.next_dts;
+            r.nal_length_size = track.nal_length_size;
+            r.parameter_set_count = track.parameter_sets.size();
+            std::string strings;
+            auto add_string = [&strings](const std::string &s) {
+                uint32_t n = s.size();
+                strings.append(reinterpret_cast<const char *>(&n), 4);
+                strings.append(s);
+            };
+            add_string(track.handler);
+            add_string(track.codec);
+            for (const auto &parameter_set : track.parameter_sets) {
+                add_string(parameter_set);
+            }
+            r.strings = put(strings.data(), strings.size());
+            r.strings_size = strings.size();
+            r.sample_count = track.sample_count();
+            r.cts_count = track.cts_offsets.size();
+            r.sync_count = track.sync_bits.size();
+            r.sizes = put(track.sizes.data(), track.sizes.size_bytes());
+            r.offsets = put(track.offsets.data(), track.offsets.size_bytes());
+            r.dts = put(track.dts.data(), track.dts.size_bytes());
+            r.cts_offsets =
+                put(track.cts_offsets.data(), track.cts_offsets.size_bytes());
+            r.sync_bits =
+                put(track.sync_bits.data(), track.sync_bits.size_bytes());
+            records.push_back(r);
+        }
+
+        std::vector<SegmentRecord> segments;
+        for (const auto &index : reader.segment_indexes) {
+            segments.push_back({index.reference_id, index.timescale,
+                                index.earliest_presentation_time,
+                                index.references.size(),
+                                put(index.references.data(),
+                                    index.references.size() *
+                                        sizeof(SegmentIndex::Reference))});
+        }
+
+        header.track_count = records.size();
+        header.tracks =
+            put(records.data(), records.size() * sizeof(TrackRecord));
+        header.segment_count = segments.size();
+        header.segments =
+            put(segments.data(), segments.size() * sizeof(SegmentRecord));
+        std::memcpy(&image[0], &header, sizeof(header));
+
+        std::string temporary =
+            path_for(file) + ".tmp" + std::to_string(getpid());
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = ::write(fd, image.data(), image.size()) ==
+                  static_cast<ssize_t>(image.size());
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), path_for(file).c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// 顶层盒子的位置，不进入任何容器
+struct RootBox {
+    FourCC type;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct RootBoxLister : BoxVisitor {
+    std::vector<RootBox> boxes;
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        boxes.push_back({header.type, header.beginPosition - 1, header.size});
+        return false;
+    }
+};
+
+// 在内存里拼盒子。beginBox写一个大小待定的盒子头，里面的内容写完后
+// endBox补上大小
+struct BoxBuffer {
+    std::string out;
+    std::vector<size_t> open; // 还没写大小的盒子头在out里的位置
+
+    void put32(uint32_t v) {
+        v = swap_endian(v);
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+    void put64(uint64_t v) {
+        v = swap_endian(v);
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+    void putHeader(FourCC type, uint64_t size, uint32_t headerSize) {
+        put32(headerSize == 16 ? 1 : static_cast<uint32_t>(size));
+        put32(type.value);
+        if (headerSize == 16) {
+            put64(size);
+        }
+    }
+
+    void beginBox(FourCC type, uint32_t headerSize = 8) {
+        open.push_back(out.size());
+        putHeader(type, 0, headerSize);
+    }
+    // full box：头后面跟1字节version和3字节flags
+    void beginFullBox(FourCC type, uint8_t version, uint32_t flags) {
+        beginBox(type);
+        put32(uint32_t(version) << 24 | flags);
+    }
+    void endBox(uint32_t headerSize = 8) {
+        size_t at = open.back();
+        open.pop_back();
+        uint64_t size = out.size() - at;
+        if (headerSize == 16) {
+            uint64_t v = swap_endian(size);
+            std::memcpy(&out[at + 8], &v, sizeof(v));
+        } else {
+            uint32_t v = swap_endian(static_cast<uint32_t>(size));
+            std::memcpy(&out[at], &v, sizeof(v));
+        }
+    }
+};
+
+// 重写moov：stco/co64的块偏移用remap换算，放不进32位的stco升级成co64，
+// 外层容器的大小随之更新，其它盒子原样复制
+struct ChunkOffsetRewriter : BoxVisitor, BoxBuffer {
+    std::function<uint64_t(uint64_t)> remap;
+    size_t patched = 0;  // 换算过的块偏移
+    size_t upgraded = 0; // 升级成co64的stco
+
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        if (isContainer(header.type)) {
+            beginBox(header.type, header.headerSize); // 大小在leaveBox里补
+            return true;
+        }
+        std::vector<uint8_t> payload = read_payload(input, header);
+        if ((header.type != "stco" && header.type != "co64") ||
+            payload.size() < 8) {
+            putHeader(header.type, header.size, header.headerSize);
+            out.append(payload.begin(), payload.end());
+            return false;
+        }
+
+        bool wide = header.type == "co64";
+        size_t entrySize = wide ? 8 : 4;
+        size_t count = std::min<size_t>(read_be32(payload.data() + 4),
+                                        (payload.size() - 8) / entrySize);
+        std::vector<uint64_t> offsets(count);
+        bool fits = true;
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t *p = payload.data() + 8 + i * entrySize;
+            offsets[i] = remap(wide ? read_be64(p) : read_be32(p));
+            fits = fits && offsets[i] <= UINT32_MAX;
+        }
+        patched += count;
+        if (!wide && !fits) {
+            wide = true;
+            ++upgraded;
+        }
+        entrySize = wide ? 8 : 4;
+        putHeader(wide ? FourCC("co64") : FourCC("stco"),
+                  8 + 8 + count * entrySize, 8);
+        out.append(payload.begin(), payload.begin() + 4); // version/flags
+        put32(static_cast<uint32_t>(count));
+        for (uint64_t offset : offsets) {
+            if (wide) {
+                put64(offset);
+            } else {
+                put32(static_cast<uint32_t>(offset));
+            }
+        }
+        return false;
+    }
+
+    void leaveBox(const BoxHeader &header, int depth) override {
+        if (isContainer(header.type)) {
+            endBox(header.headerSize);
+        }
+    }
+};
+
+// 把in的[offset, offset + size)追加到out的当前位置。优先用
+// copy_file_range让内核在文件之间直接拷贝，不支持时退回sendfile，再退回
+// pread/write
+inline bool copy_range(int in, int out, uint64_t offset, uint64_t size) {
+    const size_t step = 1 << 30;
+    off_t from = static_cast<off_t>(offset);
+    while (size > 0) {
+        ssize_t n = copy_file_range(in, &from, out, nullptr,
+                                    std::min<uint64_t>(size, step), 0);
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+    }
+    while (size > 0) {
+        ssize_t n = sendfile(out, in, &from, std::min<uint64_t>(size, step));
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+    }
+    std::vector<char> buffer(size > 0 ? 1 << 20 : 0);
+    while (size > 0) {
+        ssize_t n = pread(in, buffer.data(),
+                          std::min<uint64_t>(size, buffer.size()), from);
+        countRead(n > 0 ? n : 0);
+        if (n <= 0 || write(out, buffer.data(), n) != n) {
+            return false;
+        }
+        from += n;
+        size -= n;
+    }
+    return true;
+}
+
+struct FastStartResult {
+    bool moved = false; // false：moov本来就在mdat前面，文件原样复制
+    uint64_t moovSize = 0;
+    size_t patched = 0;
+    size_t upgraded = 0;
+    uint64_t copied = 0;
+};
+
+// 把moov挪到第一个mdat前面，其它顶层盒子保持原来的顺序。块偏移按它所在
+// 顶层盒子的新位置换算；stco升级会让moov变大，进而改变偏移，所以重写到
+// moov大小不再变化为止
+inline bool fast_start(const std::string &from, const std::string &to,
+                       FastStartResult &result, std::string &error) {
+    SourceStream input(from);
+    if (!input) {
+        error = "file is not exists: " + from;
+        return false;
+    }
+    RootBoxLister lister;
+    if (!walkBoxes(input, lister)) {
+        error = "bad box structure";
+        return false;
+    }
+    const auto &boxes = lister.boxes;
+    size_t moov = boxes.size();
+    size_t mdat = boxes.size();
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (boxes[i].type == "moov" && moov == boxes.size()) {
+            moov = i;
+        }
+        if (boxes[i].type == "mdat" && mdat == boxes.size()) {
+            mdat = i;
+        }
+    }
+    if (moov == boxes.size()) {
+        error = "no moov box";
+        return false;
+    }
+
+    // 新的顶层顺序
+    std::vector<size_t> order;
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (i == mdat && moov > mdat) {
+            order.push_back(moov);
+        }
+        if (i != moov || moov < mdat) {
+            order.push_back(i);
+        }
+    }
+    result.moved = moov > mdat && mdat < boxes.size();
+
+    std::string moovBytes;
+    if (result.moved) {
+        moovBytes.resize(boxes[moov].size);
+        input.clear();
+        input.seekg(boxes[moov].offset);
+        input.read(&moovBytes[0], moovBytes.size());
+        if (!input) {
+            error = "truncated moov";
+            return false;
+        }
+
+        std::vector<uint64_t> newOffset(boxes.size());
+        uint64_t moovSize = boxes[moov].size;
+        for (int pass = 0;; ++pass) {
+            if (pass == 4) {
+                error = "chunk offsets do not settle";
+                return false;
+            }
+            uint64_t position = 0;
+            for (size_t i : order) {
+                newOffset[i] = position;
+                position += i == moov ? moovSize : boxes[i].size;
+            }
+            ChunkOffsetRewriter rewriter;
+            rewriter.remap = [&](uint64_t offset) {
+                // 找到偏移所在的顶层盒子
+                auto it = std::upper_bound(
+                    boxes.begin(), boxes.end(), offset,
+                    [](uint64_t o, const RootBox &b) { return o < b.offset; });
+                if (it == boxes.begin()) {
+                    return offset;
+                }
+                size_t i = it - boxes.begin() - 1;
+                if (offset >= boxes[i].offset + boxes[i].size) {
+                    return offset;
+                }
+                return offset - boxes[i].offset + newOffset[i];
+            };
+            std::istringstream moovInput(moovBytes, std::ios::binary);
+            walkBoxes(moovInput, rewriter);
+            if (rewriter.out.size() == moovSize) {
+                moovBytes = std::move(rewriter.out);
+                result.patched = rewriter.patched;
+                result.upgraded = rewriter.upgraded;
+                break;
+            }
+            moovSize = rewriter.out.size();
+        }
+    }
+    result.moovSize = result.moved ? moovBytes.size() : boxes[moov].size;
+    input.close();
+
+    int in = ::open(from.c_str(), O_RDONLY);
+    int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = in >= 0 && out >= 0;
+    for (size_t i : order) {
+        if (!ok) {
+            break;
+        }
+        if (result.moved && i == moov) {
+            ok = write(out, moovBytes.data(), moovBytes.size()) ==
+                 static_cast<ssize_t>(moovBytes.size());
+        } else {
+            ok = copy_range(in, out, boxes[i].offset, boxes[i].size);
+            result.copied += boxes[i].size;
+        }
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0 && close(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        error = "cannot write " + to;
+    }
+    return ok;
+}
+
+// 从moov生成一个轨道的CMAF初始化段：只留这个轨道的trak，stbl里只留
+// stsd，其它采样表换成空表；原来的mvex去掉，moov末尾补上带trex的mvex
+struct InitSegmentWriter : BoxVisitor, BoxBuffer {
+    uint32_t track_id = 0;
+    uint32_t current_track = 0; // 正在复制的trak的tkhd里的track_id
+    size_t trak_start = 0;
+    std::vector<bool> copied; // 进入过的容器有没有写进out
+
+    bool enterBox(const BoxHeader &header, std::istream &input,
+                  int depth) override {
+        if (header.type == "mvex") {
+            copied.push_back(false);
+            return false;
+        }
+        if (header.parent_type == "stbl" && header.type != "stsd") {
+            return false;
+        }
+        if (isContainer(header.type)) {
+            if (header.type == "trak") {
+                trak_start = out.size();
+                current_track = 0;
+            }
+            copied.push_back(true);
+            beginBox(header.type, header.headerSize);
+            return true;
+        }
+        std::vector<uint8_t> payload = read_payload(input, header);
+        if (header.type == "tkhd" && payload.size() >= 24) {
+            current_track =
+                read_be32(payload.data() + (payload[0] == 1 ? 20 : 12));
+        }
+        putHeader(header.type, header.size, header.headerSize);
+        out.append(payload.begin(), payload.end());
+        return false;
+    }
+
+    void leaveBox(const BoxHeader &header, int depth) override {
+        if (!isContainer(header.type)) {
+            return;
+        }
+        bool was_copied = copied.back();
+        copied.pop_back();
+        if (!was_copied) {
+            return;
+        }
+        if (header.type == "stbl") {
+            for (FourCC type :
+                 {FourCC("stts"), FourCC("stsc"), FourCC("stco")}) {
+                beginFullBox(type, 0, 0);
+                put32(0); // entry_count
+                endBox();
+            }
+            beginFullBox("stsz", 0, 0);
+            put32(0); // sample_size
+            put32(0); // sample_count
+            endBox();
+        } else if (header.type == "moov") {
+            beginBox("mvex");
+            beginFullBox("trex", 0, 0);
+            put32(track_id);
+            put32(1); // default_sample_description_index
+            put32(0); // default_sample_duration
+            put32(0); // default_sample_size
+            put32(0); // default_sample_flags
+            endBox();
+            endBox();
+        }
+        endBox(header.headerSize);
+        if (header.type == "trak" && current_track != track_id) {
+            out.resize(trak_start);
+        }
+    }
+};
+
+// 把普通MP4切成CMAF分片。每个轨道单独输出到dir：
+// track<id>_init.mp4是ftyp+moov，track<id>_<n>.m4s是styp+moof+mdat。
+// 分片从同步采样开始，时长达到target_duration后的第一个同步采样处切开。
+// moof在内存里拼好，采样数据按文件里连续的段用copy_range直接从源文件
+// 拷进mdat，不经过用户态。各轨道在各自的线程里同时切
+struct CmafSegmenter {
+    double target_duration = 4; // 秒
+
+    struct TrackResult {
+        uint32_t track_id = 0;
+        size_t segments = 0;
+        uint64_t bytes = 0; // 写出的全部字节，含初始化段
+        std::string error;
+    };
+    std::vector<TrackResult> results;
+
+    static bool write_all(int fd, const std::string &data) {
+        return write(fd, data.data(), data.size()) ==
+               static_cast<ssize_t>(data.size());
+    }
+
+    // 写出track的采样[first, last)组成的分片
+    static bool write_segment(int in, int out, const SampleIndex &track,
+                              size_t first, size_t last, uint32_t sequence,
+                              uint64_t &bytes) {
+        bool has_cts = !track.cts_offsets.empty();
+        bool negative_cts = false;
+        uint64_t payload = 0;
+        for (size_t s = first; s < last; ++s) {
+            negative_cts = negative_cts || track.cts_offset(s) < 0;
+            payload += track.sizes[s];
+        }
+
+        BoxBuffer b;
+        b.beginBox("styp");
+        b.out.append("cmfs");
+        b.put32(0); // minor_version
+        b.out.append("cmfsmsdh");
+        b.endBox();
+
+        size_t moof_start = b.out.size();
+        b.beginBox("moof");
+        b.beginFullBox("mfhd", 0, 0);
+        b.put32(sequence);
+        b.endBox();
+        b.beginBox("traf");
+        b.beginFullBox("tfhd", 0, 0x020000); // default-base-is-moof
+        b.put32(track.track_id);
+        b.endBox();
+        b.beginFullBox("tfdt", 1, 0);
+        b.put64(track.dts[first]);
+        b.endBox();
+        // data-offset、每个采样的时长/大小/flags，有ctts时再加合成偏移
+        uint32_t flags = 0x000001 | 0x000100 | 0x000200 | 0x000400;
+        if (has_cts) {
+            flags |= 0x000800;
+        }
+        b.beginFullBox("trun", negative_cts ? 1 : 0, flags);
+        b.put32(static_cast<uint32_t>(last - first));
+        size_t data_offset_at = b.out.size();
+        b.put32(0); // data_offset，moof写完后补
+        for (size_t s = first; s < last; ++s) {
+            uint64_t next = s + 1 < track.sample_count() ? track.dts[s + 1]
+                                                         : track.next_dts;
+            b.put32(static_cast<uint32_t>(next - track.dts[s]));
+            b.put32(track.sizes[s]);
+            // 同步采样不依赖其它采样；其它采样依赖别的采样且不是同步采样
+            b.put32(track.is_sync(s) ? 0x02000000 : 0x01010000);
+            if (has_cts) {
+                b.put32(static_cast<uint32_t>(track.cts_offset(s)));
+            }
+        }
+        b.endBox();
+        b.endBox(); // traf
+        b.endBox(); // moof
+
+        uint32_t mdat_header = 8 + payload > UINT32_MAX ? 16 : 8;
+        uint32_t data_offset = swap_endian(
+            static_cast<uint32_t>(b.out.size() - moof_start + mdat_header));
+        std::memcpy(&b.out[data_offset_at], &data_offset, 4);
+        b.putHeader("mdat", mdat_header + payload, mdat_header);
+        if (!write_all(out, b.out)) {
+            return false;
+        }
+        bytes += b.out.size() + payload;
+
+        // 文件里连续的采样合成一次拷贝
+        uint64_t run_offset = 0;
+        uint64_t run_size = 0;
+        for (size_t s = first; s < last; ++s) {
+            if (run_size > 0 && track.offsets[s] == run_offset + run_size) {
+                run_size += track.sizes[s];
+                continue;
+            }
+            if (run_size > 0 && !copy_range(in, out, run_offset, run_size)) {
+                return false;
+            }
+            run_offset = track.offsets[s];
+            run_size = track.sizes[s];
+        }
+        return run_size == 0 || copy_range(in, out, run_offset, run_size);
+    }
+
+    // 一个轨道的初始化段和全部分片
+    void segment_track(int in, const std::string &moov,
+                       const SampleIndex &track, const std::string &dir,
+                       TrackResult &result) {
+        std::string prefix =
+            dir + "/track" + std::to_string(track.track_id) + "_";
+        InitSegmentWriter init;
+        init.track_id = track.track_id;
+        init.beginBox("ftyp");
+        init.out.append("iso6");
+        init.put32(0); // minor_version
+        init.out.append("iso6cmfcdash");
+        init.endBox();
+        std::istringstream moov_input(moov, std::ios::binary);
+        walkBoxes(moov_input, init);
+
+        int out = ::open((prefix + "init.mp4").c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = out >= 0 && write_all(out, init.out);
+        result.bytes += init.out.size();
+        if (out >= 0) {
+            ok = close(out) == 0 && ok;
+        }
+
+        uint64_t target = static_cast<uint64_t>(target_duration *
+                                                track.timescale);
+        size_t count = track.sample_count();
+        for (size_t first = 0; ok && first < count;) {
+            size_t last = first + 1;
+            while (last < count && !(track.dts[last] - track.dts[first] >=
+                                         target &&
+                                     track.is_sync(last))) {
+                ++last;
+            }
+            std::string name =
+                prefix + std::to_string(result.segments + 1) + ".m4s";
+            out = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = out >= 0 &&
+                 write_segment(in, out, track, first, last,
+                               result.segments + 1, result.bytes);
+            if (out >= 0) {
+                ok = close(out) == 0 && ok;
+            }
+            ++result.segments;
+            first = last;
+        }
+        if (!ok) {
+            result.error = "cannot write " + prefix + "*";
+        }
+    }
+
+    bool run(const std::string &from, const std::string &dir,
+             std::string &error) {
+        SourceStream input(from);
+        if (!input) {
+            error = "file is not exists: " + from;
+            return false;
+        }
+        RootBoxLister lister;
+        SampleTableReader reader;
+        if (!walkBoxes(input, lister) || !walkBoxes(input, reader)) {
+            error = "bad box structure";
+            return false;
+        }
+        std::string moov;
+        for (const auto &box : lister.boxes) {
+            if (box.type == "moov") {
+                moov.resize(box.size);
+                input.clear();
+                input.seekg(box.offset);
+                input.read(&moov[0], moov.size());
+                break;
+            }
+        }
+        if (moov.empty() || !input) {
+            error = "no moov box";
+            return false;
+        }
+        input.close();
+        mkdir(dir.c_str(), 0755);
+
+        int in = ::open(from.c_str(), O_RDONLY);
+        if (in < 0) {
+            error = "file is not exists: " + from;
+            return false;
+        }
+        results.clear();
+        std::vector<const SampleIndex *> tracks;
+        for (const auto &track : reader.tracks) {
+            if (track.sample_count() > 0 && track.timescale > 0) {
+                tracks.push_back(&track);
+                results.push_back({track.track_id});
+            }
+        }
+        // copy_range按偏移读，各线程可以共用一个fd
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            threads.emplace_back([&, i] {
+                segment_track(in, moov, *tracks[i], dir, results[i]);
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        close(in);
+        for (const auto &result : results) {
+            if (!result.error.empty()) {
+                error = result.error;
+                return false;
+            }
+        }
+        if (results.empty()) {
+            error = "no samples to segment";
+            return false;
+        }
+        return true;
+    }
+};
+
+// 把一个H.264/H.265轨道导出成Annex B裸流。按解码顺序把文件里相邻或间隔
+// 很小的采样合成一批，用一次preadv读进缓冲区，间隙读进丢弃区；然后把每个
+// NAL的长度前缀换成起始码，起始码和NAL都作为iovec交给writev，不再复制。
+// 同步采样前面补上参数集，采样里自带参数集时不补
+struct AnnexBWriter {
+    static constexpr size_t batch_bytes = 4 << 20;
+    static constexpr size_t max_gap = 64 << 10;
+    static constexpr size_t max_iov = 1024;
+
+    size_t samples = 0;
+    size_t inserted = 0; // 补了参数集的同步采样
+    size_t reads = 0;    // preadv调用次数
+    size_t writes = 0;   // writev调用次数
+    uint64_t bytes_out = 0;
+
+    bool preadv_all(int fd, std::vector<iovec> &iov, uint64_t offset) {
+        size_t k = 0;
+        while (k < iov.size()) {
+            ssize_t n = preadv(fd, iov.data() + k, iov.size() - k, offset);
+            ++reads;
+            countRead(n > 0 ? n : 0);
+            if (n <= 0) {
+                return false;
+            }
+            offset += n;
+            for (; k < iov.size() && size_t(n) >= iov[k].iov_len; ++k) {
+                n -= iov[k].iov_len;
+            }
+            if (n > 0) {
+                iov[k].iov_base = static_cast<char *>(iov[k].iov_base) + n;
+                iov[k].iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    bool writev_all(int fd, std::vector<iovec> &iov) {
+        size_t k = 0;
+        while (k < iov.size()) {
+            ssize_t n = writev(fd, iov.data() + k, iov.size() - k);
+            ++writes;
+            if (n <= 0) {
+                return false;
+            }
+            bytes_out += n;
+            for (; k < iov.size() && size_t(n) >= iov[k].iov_len; ++k) {
+                n -= iov[k].iov_len;
+            }
+            if (n > 0) {
+                iov[k].iov_base = static_cast<char *>(iov[k].iov_base) + n;
+                iov[k].iov_len -= n;
+            }
+        }
+        iov.clear();
+        return true;
+    }
+
+    bool run(int in, int out, const SampleIndex &track, std::string &error) {
+        static const uint8_t start_code[4] = {0, 0, 0, 1};
+        const bool hevc = track.codec == "hvc1" || track.codec == "hev1";
+        const int length_size = track.nal_length_size;
+        if (length_size != 1 && length_size != 2 && length_size != 4) {
+            error = "bad NAL length size in " + track.codec;
+            return false;
+        }
+
+        std::vector<uint8_t> buffer;
+        std::vector<uint8_t> gap(max_gap);
+        std::vector<iovec> read_iov;
+        std::vector<iovec> write_iov;
+        std::vector<size_t> positions; // 批内每个采样在buffer里的位置
+        bool written = true;
+        auto emit = [&](const void *data, size_t size) {
+            if (write_iov.size() == max_iov) {
+                written = writev_all(out, write_iov) && written;
+            }
+            write_iov.push_back({const_cast<void *>(data), size});
+        };
+
+        const size_t count = track.sample_count();
+        size_t i = 0;
+        while (i < count) {
+            // 这一批：文件里往后排、间隙不大、总量不超过batch_bytes的采样
+            size_t first = i;
+            uint64_t end = track.offsets[i];
+            size_t used = 0;
+            size_t segments = 0;
+            for (; i < count; ++i) {
+                uint64_t offset = track.offsets[i];
+                if (i > first &&
+                    (offset < end || offset - end > max_gap ||
+                     used + track.sizes[i] > batch_bytes ||
+                     segments + 2 > max_iov)) {
+                    break;
+                }
+                segments += offset > end ? 2 : i == first;
+                used += track.sizes[i];
+                end = offset + track.sizes[i];
+            }
+
+            buffer.resize(std::max(buffer.size(), used));
+            read_iov.clear();
+            positions.clear();
+            used = 0;
+            end = track.offsets[first];
+            for (size_t s = first; s < i; ++s) {
+                uint64_t offset = track.offsets[s];
+                if (offset > end) {
+                    read_iov.push_back({gap.data(), size_t(offset - end)});
+                }
+                if (offset > end || s == first) {
+                    read_iov.push_back({buffer.data() + used, 0});
+                }
+                read_iov.back().iov_len += track.sizes[s];
+                positions.push_back(used);
+                used += track.sizes[s];
+                end = offset + track.sizes[s];
+            }
+            if (!preadv_all(in, read_iov, track.offsets[first])) {
+                error = "truncated sample data";
+                return false;
+            }
+
+            for (size_t s = first; s < i; ++s) {
+                const uint8_t *sample = buffer.data() + positions[s - first];
+                size_t size = track.sizes[s];
+                // 先扫一遍NAL，看采样里有没有自带参数集
+                bool has_parameter_sets = false;
+                size_t nal_count = 0;
+                for (size_t at = 0; at + length_size <= size;) {
+                    size_t length = 0;
+                    for (int b = 0; b < length_size; ++b) {
+                        length = length << 8 | sample[at + b];
+                    }
+                    at += length_size;
+                    if (length == 0 || length > size - at) {
+                        break;
+                    }
+                    int type = hevc ? (sample[at] >> 1) & 0x3F : sample[at] & 0x1F;
+                    has_parameter_sets |= hevc ? type >= 32 && type <= 34
+                                               : type == 7 || type == 8;
+                    ++nal_count;
+                    at += length;
+                }
+                if (track.is_sync(s) && !has_parameter_sets &&
+                    !track.parameter_sets.empty()) {
+                    for (const auto &set : track.parameter_sets) {
+                        emit(start_code, sizeof(start_code));
+                        emit(set.data(), set.size());
+                    }
+                    ++inserted;
+                }
+                size_t at = 0;
+                for (size_t n = 0; n < nal_count; ++n) {
+                    size_t length = 0;
+                    for (int b = 0; b < length_size; ++b) {
+                        length = length << 8 | sample[at + b];
+                    }
+                    at += length_size;
+                    emit(start_code, sizeof(start_code));
+                    emit(sample + at, length);
+                    at += length;
+                }
+                ++samples;
+            }
+            // iovec指向buffer，下一批读之前写完
+            if (!writev_all(out, write_iov) || !written) {
+                error = "write failed";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// --batch：每个文件输出一行JSON摘要。每个线程的ifstream整个批次都用
+// 同一块读缓冲区，摘要攒够64 KiB再一起写出
+struct Mp4BatchScanner {
+    static constexpr size_t stream_buffer_size = 256 << 10;
+
+    struct Worker {
+        std::vector<char> stream_buffer = std::vector<char>(stream_buffer_size);
+        std::string out; // 还没写出的记录
+    };
+
+    size_t threads = std::thread::hardware_concurrency();
+    size_t errors = 0;  // 记录里带错误的文件
+    uint64_t bytes = 0; // 所有文件的大小
+
+    // 把path的记录追加到worker.out，有错误时返回false
+    bool scan(const std::string &path, Worker &worker, uint64_t &size) {
+        std::string &out = worker.out;
+        out += "{\"path\":";
+        appendJson(out, path);
+
+        std::ifstream input;
+        input.rdbuf()->pubsetbuf(worker.stream_buffer.data(),
+                                 worker.stream_buffer.size());
+        input.open(path, std::ios::binary);
+        SampleTableReader reader;
+        std::string error;
+        size = 0;
+        if (!input) {
+            error = "cannot read file";
+        } else {
+            input.seekg(0, std::ios::end);
+            size = static_cast<uint64_t>(input.tellg());
+            if (!walkBoxes(input, reader)) {
+                error = "bad box structure";
+            } else if (reader.tracks.empty()) {
+                error = "no moov box";
+            }
+        }
+
+        double duration = 0;
+        std::string tracks;
+        for (const auto &track : reader.tracks) {
+            // 分片文件的mdhd时长通常是0，用采样的解码时间
+            uint64_t units = std::max(track.duration, track.next_dts);
+            double seconds =
+                track.timescale ? double(units) / track.timescale : 0;
+            duration = std::max(duration, seconds);
+            char fields[160];
+            snprintf(fields, sizeof(fields),
+                     "%s{\"id\":%u,\"handler\":", tracks.empty() ? "" : ",",
+                     track.track_id);
+            tracks += fields;
+            appendJson(tracks, track.handler);
+            tracks += ",\"codec\":";
+            appendJson(tracks, track.codec);
+            snprintf(fields, sizeof(fields),
+                     ",\"width\":%u,\"height\":%u,\"samples\":%zu,"
+                     "\"duration\":%.3f}",
+                     track.width, track.height, track.sample_count(), seconds);
+            tracks += fields;
+        }
+
+        char fields[160];
+        snprintf(fields, sizeof(fields),
+                 ",\"size\":%llu,\"duration\":%.3f,\"fragments\":%zu,"
+                 "\"tracks\":[",
+                 static_cast<unsigned long long>(size), duration,
+                 reader.fragments);
+        out += fields;
+        out += tracks;
+        out += "],\"error\":";
+        if (error.empty()) {
+            out += "null";
+        } else {
+            appendJson(out, error);
+        }
+        out += "}\n";
+        return error.empty();
+    }
+
+    // 每个文件一条记录写到output，顺序不定
+    void run(const std::vector<std::string> &files, FILE *output) {
+        threads = std::max<size_t>(1, threads);
+        std::vector<Worker> workers(threads);
+        std::mutex output_mutex;
+        std::atomic<size_t> failed{0};
+        std::atomic<uint64_t> total{0};
+        auto flush = [&](Worker &worker) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            fwrite(worker.out.data(), 1, worker.out.size(), output);
+            worker.out.clear();
+        };
+        WorkStealingPool::run(
+            files.size(), workers.size(), [&](size_t w, size_t task) {
+                Worker &worker = workers[w];
+                uint64_t size = 0;
+                if (!scan(files[task], worker, size)) {
+                    ++failed;
+                }
+                total += size;
+                if (worker.out.size() >= 64 << 10) {
+                    flush(worker);
+                }
+            });
+        for (auto &worker : workers) {
+            flush(worker);
+        }
+        errors = failed;
+        bytes = total;
+    }
+};
+
+// --bench：在合成的语料上测遍历盒子、建盒子树、解采样表和查采样的吞吐。
+// 生成器都是确定的，同样的参数每次生成同样的文件
+
+// 只有一个1080p视频轨道的普通MP4：每个块per_chunk个采样，每key_interval个
+// 一个关键帧，有ctts；采样大小在1到8字节之间轮换，载荷全是0
+inline std::string make_synthetic_mp4(uint32_t samples, uint32_t per_chunk,
+                                      uint32_t key_interval) {
+    const uint32_t timescale = 30000;
+    const uint32_t delta = 1001;
+    const uint64_t duration = uint64_t(samples) * delta;
+    auto sample_size = [](uint32_t i) { return 1 + i % 8; };
+    const uint32_t chunks = (samples + per_chunk - 1) / per_chunk;
+
+    BoxBuffer b;
+    b.beginBox("ftyp");
+    b.out.append("isom");
+    b.put32(0x200); // minor_version
+    b.out.append("isomavc1");
+    b.endBox();
+
+    const uint32_t matrix[9] = {0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000};
+    b.beginBox("moov");
+    b.beginFullBox("mvhd", 0, 0);
+    b.put32(0); // creation_time
+    b.put32(0); // modification_time
+    b.put32(1000);
+    b.put32(static_cast<uint32_t>(duration * 1000 / timescale));
+    b.put32(0x00010000); // rate
+    b.put32(0x01000000); // volume，reserved
+    b.out.append(8, '\0');
+    for (uint32_t v : matrix) {
+        b.put32(v);
+    }
+    b.out.append(24, '\0'); // pre_defined
+    b.put32(2);             // next_track_ID
+    b.endBox();
+
+    b.beginBox("trak");
+    b.beginFullBox("tkhd", 0, 3);
+    b.put32(0);
+    b.put32(0);
+    b.put32(1); // track_ID
+    b.put32(0);
+    b.put32(static_cast<uint32_t>(duration * 1000 / timescale));
+    b.out.append(16, '\0'); // reserved，layer，alternate_group，volume
+    for (uint32_t v : matrix) {
+        b.put32(v);
+    }
+    b.put32(1920 << 16);
+    b.put32(1080 << 16);
+    b.endBox();
+
+    b.beginBox("mdia");
+    b.beginFullBox("mdhd", 0, 0);
+    b.put32(0);
+    b.put32(0);
+    b.put32(timescale);
+    b.put32(static_cast<uint32_t>(duration));
+    b.put32(0x55C40000); // und
+    b.endBox();
+    b.beginFullBox("hdlr", 0, 0);
+    b.put32(0);
+    b.out.append("vide");
+    b.out.append(12, '\0');
+    b.out.append("synthetic", 10);
+    b.endBox();
+
+    b.beginBox("minf");
+    b.beginBox("stbl");
+    b.beginFullBox("stsd", 0, 0);
+    b.put32(1);
+    b.beginBox("avc1");
+    b.put32(0); // reserved
+    b.put32(1); // reserved，data_reference_index
+    b.out.append(16, '\0');
+    b.put32(1920 << 16 | 1080);
+    b.put32(0x00480000); // 72 dpi
+    b.put32(0x00480000);
+    b.put32(0);
+    b.out.append("\x00\x01", 2); // frame_count
+    b.out.append(32, '\0');      // compressorname
+    b.out.append("\x00\x18\xFF\xFF", 4);
+    b.beginBox("avcC"); // 4字节NAL长度，没有参数集
+    b.out.append("\x01\x64\x00\x1F\xFF\xE0\x00", 7);
+    b.endBox();
+    b.endBox();
+    b.endBox();
+
+    b.beginFullBox("stts", 0, 0);
+    b.put32(1);
+    b.put32(samples);
+    b.put32(delta);
+    b.endBox();
+
+    b.beginFullBox("ctts", 0, 0); // I P B B ...的显示延迟
+    b.put32(samples);
+    for (uint32_t i = 0; i < samples; ++i) {
+        b.put32(1);
+        b.put32(i % 3 == 1 ? 3 * delta : delta);
+    }
+    b.endBox();
+
+    b.beginFullBox("stss", 0, 0);
+    b.put32((samples + key_interval - 1) / key_interval);
+    for (uint32_t i = 0; i < samples; i += key_interval) {
+        b.put32(i + 1);
+    }
+    b.endBox();
+
+    b.beginFullBox("stsc", 0, 0);
+    uint32_t rest = samples % per_chunk;
+    b.put32(rest && chunks > 1 ? 2 : 1);
+    b.put32(1);
+    b.put32(chunks > 1 || !rest ? per_chunk : rest);
+    b.put32(1);
+    if (rest && chunks > 1) {
+        b.put32(chunks);
+        b.put32(rest);
+        b.put32(1);
+    }
+    b.endBox();
+
+    b.beginFullBox("stsz", 0, 0);
+    b.put32(0);
+    b.put32(samples);
+    for (uint32_t i = 0; i < samples; ++i) {
+        b.put32(sample_size(i));
+    }
+    b.endBox();
+
+    b.beginFullBox("stco", 0, 0);
+    b.put32(chunks);
+    size_t offsets_at = b.out.size();
+    b.out.append(size_t(chunks) * 4, '\0'); // moov写完才知道mdat在哪
+    b.endBox();
+    b.endBox(); // stbl
+    b.endBox(); // minf
+    b.endBox(); // mdia
+    b.endBox(); // trak
+    b.endBox(); // moov
+
+    uint64_t offset = b.out.size() + 8;
+    for (uint32_t c = 0; c < chunks; ++c) {
+        uint32_t v = swap_endian(static_cast<uint32_t>(offset));
+        std::memcpy(&b.out[offsets_at + size_t(c) * 4], &v, sizeof(v));
+        for (uint32_t i = c * per_chunk;
+             i < std::min(samples, (c + 1) * per_chunk); ++i) {
+            offset += sample_size(i);
+        }
+    }
+    b.beginBox("mdat");
+    b.out.append(offset - b.out.size(), '\0');
+    b.endBox();
+    return b.out;
+}
+
+// moov里套depth层udta，最里面一个free：对付递归遍历的输入
+inline std::string make_nested_mp4(int depth) {
+    BoxBuffer b;
+    b.beginBox("ftyp");
+    b.out.append("isom");
+    b.put32(0);
+    b.endBox();
+    b.beginBox("moov");
+    for (int i = 0; i < depth; ++i) {
+        b.beginBox("udta");
+    }
+    b.beginBox("free");
+    b.endBox();
+    for (int i = 0; i <= depth; ++i) {
+        b.endBox();
+    }
+    return b.out;
+}
+
+// count个8字节的空free盒子：每个盒子的固定开销
+inline std::string make_flat_mp4(int count) {
+    BoxBuffer b;
+    b.beginBox("ftyp");
+    b.out.append("isom");
+    b.put32(0);
+    b.endBox();
+    for (int i = 0; i < count; ++i) {
+        b.beginBox("free");
+        b.endBox();
+    }
+    return b.out;
+}
+
+// 把progressive切成CMAF分片再拼回一个文件：初始化段加全部分片
+inline bool make_fragmented_mp4(const std::string &progressive,
+                                const std::string &dir,
+                                const std::string &to) {
+    CmafSegmenter segmenter;
+    segmenter.target_duration = 1;
+    std::string error;
+    if (!segmenter.run(progressive, dir, error) ||
+        segmenter.results.size() != 1) {
+        return false;
+    }
+    std::ofstream out(to, std::ios::binary);
+    std::string prefix = dir + "/track1_";
+    std::vector<std::string> parts = {prefix + "init.mp4"};
+    for (size_t i = 1; i <= segmenter.results[0].segments; ++i) {
+        parts.push_back(prefix + std::to_string(i) + ".m4s");
+    }
+    for (const auto &part : parts) {
+        std::ifstream in(part, std::ios::binary);
+        out << in.rdbuf();
+        unlink(part.c_str());
+    }
+    rmdir(dir.c_str());
+    return static_cast<bool>(out);
+}
+
+// 每项测量同时记下来，--json时存盘
+BenchReport bench_report;
+
+// f()里的堆分配次数，不计数时是-1
+template <typename F> double count_allocations(F f) {
+    long long before = allocationCount();
+    f();
+    return before < 0 ? -1 : static_cast<double>(allocationCount() - before);
+}
+
+// 取三次里最快的一次，单位秒
+template <typename F> double best_of_three(F f) {
+    double best = 1e30;
+    for (int round = 0; round < 3; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count());
+    }
+    return best;
+}
+
+inline void bench_file(const std::string &name, const std::string &path) {
+    struct BoxCounter : BoxVisitor {
+        size_t boxes = 0;
+        bool enterBox(const BoxHeader &, std::istream &, int) override {
+            ++boxes;
+            return true;
+        }
+    };
+    uint64_t size = std::filesystem::file_size(path);
+    double mb = size / 1e6;
+
+    size_t boxes = 0;
+    double walk = best_of_three([&] {
+        SourceStream input(path);
+        BoxCounter counter;
+        walkBoxes(input, counter);
+        boxes = counter.boxes;
+    });
+    double walk_allocations = count_allocations([&] {
+        SourceStream input(path);
+        BoxCounter counter;
+        walkBoxes(input, counter);
+    });
+    double tree = best_of_three([&] {
+        SourceStream input(path);
+        BoxTreeBuilder builder;
+        walkBoxes(input, builder);
+    });
+    double tree_allocations = count_allocations([&] {
+        SourceStream input(path);
+        BoxTreeBuilder builder;
+        walkBoxes(input, builder);
+    });
+    size_t samples = 0;
+    double table = best_of_three([&] {
+        SourceStream input(path);
+        SampleTableReader reader;
+        walkBoxes(input, reader);
+        samples = 0;
+        for (const auto &track : reader.tracks) {
+            samples += track.sample_count();
+        }
+    });
+    double table_allocations = count_allocations([&] {
+        SourceStream input(path);
+        SampleTableReader reader;
+        walkBoxes(input, reader);
+    });
+
+    std::cout << std::fixed << std::setprecision(1)                       //
+              << name << ": " << boxes << " boxes, walk "                 //
+              << boxes / walk / 1e6 << " Mboxes/s (" << walk * 1e3        //
+              << " ms), tree " << tree * 1e3 << " ms"                     //
+              << ", allocations walk/tree/samples "                       //
+              << std::setprecision(0) << walk_allocations << "/"          //
+              << tree_allocations << "/" << table_allocations << std::endl
+              << std::setprecision(1);
+    bench_report.add(name, "walk",
+                     {{"mb_per_s", mb / walk},
+                      {"boxes_per_s", boxes / walk},
+                      {"allocations", walk_allocations}});
+    bench_report.add(name, "box tree",
+                     {{"mb_per_s", mb / tree},
+                      {"boxes_per_s", boxes / tree},
+                      {"allocations", tree_allocations}});
+    if (samples == 0) {
+        std::cout << std::defaultfloat;
+        return;
+    }
+
+    SourceStream input(path);
+    SampleTableReader reader;
+    walkBoxes(input, reader);
+    const SampleIndex &track = reader.tracks[0];
+    const size_t lookups = 1000000;
+    size_t found = 0;
+    double lookup = best_of_three([&] {
+        uint64_t t = 0;
+        for (size_t i = 0; i < lookups; ++i) {
+            t = (t + 7919 * 1001) % std::max<uint64_t>(track.duration, 1);
+            found += track.nearest_keyframe_before(t) != SIZE_MAX;
+        }
+    });
+    std::cout << name << ": " << samples << " samples, decode "       //
+              << samples / table / 1e6 << " Msamples/s ("             //
+              << table * 1e3 << " ms), keyframe lookup "              //
+              << lookup / lookups * 1e9 << " ns" << std::endl;
+    std::cout << std::defaultfloat;
+    bench_report.add(name, "sample table",
+                     {{"mb_per_s", mb / table},
+                      {"samples_per_s", samples / table},
+                      {"allocations", table_allocations}});
+    bench_report.add(name, "keyframe lookup",
+                     {{"ns", lookup / lookups * 1e9}});
+}
+
+inline int bench(const char *file, const char *json) {
+    if (file) {
+        if (!std::filesystem::exists(file)) {
+            std::cout << "file is not exists: " << file << std::endl;
+            return -1;
+        }
+        bench_file(file, file);
+    }
+
+    char dir[] = "/tmp/mp4_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cout << "cannot create a temporary directory" << std::endl;
+        return -1;
+    }
+    auto save = [&dir](const std::string &name, const std::string &data) {
+        std::string path = std::string(dir) + "/" + name;
+        std::ofstream(path, std::ios::binary) << data;
+        return path;
+    };
+
+    struct {
+        const char *name;
+        uint32_t samples;
+    } progressive[] = {
+        {"synthetic 1080p 10k samples", 10000},
+        {"synthetic 1080p 2M samples", 2000000},
+    };
+    for (const auto &c : progressive) {
+        std::string path = save("progressive.mp4",
+                                make_synthetic_mp4(c.samples, 30, 60));
+        bench_file(c.name, path);
+        if (c.samples == 10000) {
+            std::string fragmented = std::string(dir) + "/fragmented.mp4";
+            if (make_fragmented_mp4(path, std::string(dir) + "/segments",
+                                    fragmented)) {
+                bench_file("synthetic 1080p 10k samples fragmented",
+                           fragmented);
+            }
+            unlink(fragmented.c_str());
+        }
+        unlink(path.c_str());
+    }
+
+    // 远超maxBoxDepth：测的是报错路径，不该把栈用完
+    std::string path = save("nested.mp4", make_nested_mp4(1000000));
+    bench_file("adversarial 1M nested boxes", path);
+    unlink(path.c_str());
+    path = save("flat.mp4", make_flat_mp4(1000000));
+    bench_file("adversarial 1M empty boxes", path);
+    unlink(path.c_str());
+    rmdir(dir);
+
+    if (json && !bench_report.save(json, "mp4_parser")) {
+        std::cout << "cannot write " << json << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    // --cache把--samples/--seek/--demux的采样索引存到"<文件>.idx"，
+    // 下次直接映射；--stats统计每种盒子的耗时、字节数和读文件的系统调用，
+    // 结束时以JSON写到stderr
+    bool use_cache = false;
+    StatsDump stats("mp4_parser");
+    for (; argc > 1; --argc, ++argv) {
+        std::string flag(argv[1]);
+        if (flag == "--cache") {
+            use_cache = true;
+        } else if (flag == "--stats") {
+            stats.enable();
+        } else {
+            break;
+        }
+    }
+
+    if (argc <= 1) {
+        std::cout << "Usage: mp4_parser [--stsz | --samples | --seek <seconds> "
+                     "| --live] <mp4 file>"
+                  << std::endl
+                  << "       mp4_parser --faststart <mp4 file> <output file>"
+                  << std::endl
+                  << "       mp4_parser --demux <mp4 file> <output.h264|.h265>"
+                  << std::endl
+                  << "       mp4_parser --segment <mp4 file> <output dir> "
+                     "[target seconds]"
+                  << std::endl
+                  << "       mp4_parser --batch <directory | list file> "
+                     "[threads]"
+                  << std::endl
+                  << "       mp4_parser --ranges <t0> <t1> <max gap bytes> "
+                     "<mp4 file>"
+                  << std::endl
+                  << "       mp4_parser --bench [mp4 file] [--json results.json]"
+                  << std::endl
+                  << "       --cache before --samples, --seek, --ranges or "
+                     "--demux keeps the sample index in <mp4 file>.idx"
+                  << std::endl
+                  << "       --stats before any of them writes per-box "
+                     "timings, read calls and seeks as JSON to stderr"
+                  << std::endl;
+        return 0;
+    }
+
+    if (std::string(argv[1]) == "--bench") {
+        // --bench [mp4 file] [--json results.json]
+        const char *file = nullptr;
+        const char *json = nullptr;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--json" && i + 1 < argc) {
+                json = argv[++i];
+            } else {
+                file = argv[i];
+            }
+        }
+        return bench(file, json);
+    }
+
+    if (std::string(argv[1]) == "--demux" && argc > 3) {
+        SourceStream input(argv[2]);
+        if (!input) {
+            std::cout << "file is not exists: " << argv[2] << std::endl;
+            return -1;
+        }
+        SampleTableReader reader;
+        if (!use_cache || !SampleIndexCache::load(argv[2], reader)) {
+            walkBoxes(input, reader);
+            if (use_cache) {
+                SampleIndexCache::save(argv[2], reader);
+            }
+        }
+        const SampleIndex *video = nullptr;
+        for (const auto &track : reader.tracks) {
+            if (!video && (track.codec == "avc1" || track.codec == "avc3" ||
+                           track.codec == "hvc1" || track.codec == "hev1")) {
+                video = &track;
+            }
+        }
+        if (!video) {
+            std::cout << "no H.264/H.265 track in " << argv[2] << std::endl;
+            return -1;
+        }
+        int in = ::open(argv[2], O_RDONLY);
+        int out = ::open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 || out < 0) {
+            std::cout << "cannot open " << (in < 0 ? argv[2] : argv[3])
+                      << std::endl;
+            return -1;
+        }
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        AnnexBWriter writer;
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = writer.run(in, out, *video, error);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        close(in);
+        ok = close(out) == 0 && ok;
+        if (!ok) {
+            std::cout << (error.empty() ? "write failed" : error) << std::endl;
+            return -1;
+        }
+        std::cout << "track " << video->track_id << " (" << video->codec
+                  << "): " << writer.samples << " samples, "
+                  << writer.inserted << " keyframes given parameter sets, "
+                  << writer.bytes_out << " bytes in " << writer.reads
+                  << " preadv / " << writer.writes << " writev calls, "
+                  << writer.bytes_out / std::max(seconds, 1e-9) / 1e6
+                  << " MB/s" << std::endl;
+        return 0;
+    }
+
+    if (std::string(argv[1]) == "--batch" && argc > 2) {
+        Mp4BatchScanner scanner;
+        if (argc > 3) {
+            scanner.threads = std::atol(argv[3]);
+        }
+        auto files = collectBatchFiles(argv[2], {".mp4", ".m4v", ".m4a",
+                                                 ".mov", ".3gp", ".m4s"});
+        auto start = std::chrono::steady_clock::now();
+        scanner.run(files, stdout);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::fflush(stdout);
+        std::cerr << files.size() << " files (" << scanner.errors
+                  << " with errors), " << scanner.bytes << " bytes in "
+                  << seconds << " s, " << files.size() / std::max(seconds, 1e-9)
+                  << " files/s on " << scanner.threads << " threads"
+                  << std::endl;
+        return 0;
+    }
+
+    if (std::string(argv[1]) == "--segment" && argc > 3) {
+        CmafSegmenter segmenter;
+        if (argc > 4) {
+            segmenter.target_duration = std::atof(argv[4]);
+        }
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        if (!segmenter.run(argv[2], argv[3], error)) {
+            std::cout << error << std::endl;
+            return -1;
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        uint64_t bytes = 0;
+        for (const auto &result : segmenter.results) {
+            std::cout << "track " << result.track_id << ": "
+                      << result.segments << " segments, " << result.bytes
+                      << " bytes" << std::endl;
+            bytes += result.bytes;
+        }
+        std::cout << "wrote " << bytes << " bytes in " << seconds << " s ("
+                  << bytes / std::max(seconds, 1e-9) / 1e6 << " MB/s)"
+                  << std::endl;
+        return 0;
+    }
+
+    if (std::string(argv[1]) == "--faststart" && argc > 3) {
+        FastStartResult result;
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        if (!fast_start(argv[2], argv[3], result, error)) {
+            std::cout << error << std::endl;
+            return -1;
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        if (result.moved) {
+            std::cout << "moved moov (" << result.moovSize
+                      << " bytes) before mdat, patched " << result.patched
+                      << " chunk offsets, upgraded " << result.upgraded
+                      << " stco to co64" << std::endl;
+        } else {
+            std::cout << "moov is already before mdat, copied as is"
+                      << std::endl;
+        }
+        std::cout << "copied " << result.copied << " bytes in " << seconds
+                  << " s (" << result.copied / std::max(seconds, 1e-9) / 1e6
+                  << " MB/s)" << std::endl;
+        return 0;
+    }
+
+    std::string option;
+    double seconds = 0;
+    double end_seconds = 0;
+    uint64_t max_gap = 0;
+    int arg = 1;
+    if ((std::string(argv[arg]) == "--stsz" ||
+         std::string(argv[arg]) == "--samples" ||
+         std::string(argv[arg]) == "--live") &&
+        argc > 2) {
+        option = argv[arg++];
+    } else if (std::string(argv[arg]) == "--seek" && argc > 3) {
+        option = argv[arg++];
+        seconds = std::atof(argv[arg++]);
+    } else if (std::string(argv[arg]) == "--ranges" && argc > 5) {
+        option = argv[arg++];
+        seconds = std::atof(argv[arg++]);
+        end_seconds = std::atof(argv[arg++]);
+        max_gap = std::strtoull(argv[arg++], nullptr, 10);
+    }
+
+    std::string file(argv[arg]);
+
+    // --live跟着文件增长读，只能用ifstream
+    std::ifstream live;
+    SourceStream source;
+    std::istream &input = option == "--live" ? static_cast<std::istream &>(live)
+                                             : source;
+    if (option == "--live") {
+        live.open(file, std::ios::binary);
+    } else {
+        source.open(file);
+    }
+
+    if (!input) {
+        std::cout << "file is not exists: " << file << std::endl;
+        return -1;
+    }
+
+    if (option == "--stsz") {
+        SampleCountReader reader(std::cout);
+        walkBoxes(input, reader);
+        return 0;
+    }
+
+    if (option == "--live") {
+        // 跟着不断写入的文件，每来一个完整的顶层盒子就追加，
+        // 文件停止增长几秒后退出
+        SampleTableReader reader;
+        size_t samples = 0;
+        for (int idle = 0; idle < 10;) {
+            if (reader.update(input) == 0) {
+                ++idle;
+                usleep(500 * 1000);
+                continue;
+            }
+            idle = 0;
+            size_t total = 0;
+            for (const auto &track : reader.tracks) {
+                total += track.sample_count();
+            }
+            std::cout << "position=" << reader.position
+                      << ", fragments=" << reader.fragments
+                      << ", samples=" << total << " (+" << total - samples
+                      << ")" << std::endl;
+            samples = total;
+        }
+        return 0;
+    }
+
+    SampleTableReader reader;
+    if (option == "--samples" || option == "--seek" || option == "--ranges") {
+        if (!use_cache || !SampleIndexCache::load(file, reader)) {
+            walkBoxes(input, reader);
+            if (use_cache) {
+                SampleIndexCache::save(file, reader);
+            }
+        }
+    }
+
+    if (option == "--ranges") {
+        std::vector<const SampleIndex *> tracks;
+        for (const auto &track : reader.tracks) {
+            tracks.push_back(&track);
+        }
+        uint64_t total = 0;
+        for (const auto &range : plan_byte_ranges(tracks, seconds,
+                                                  end_seconds, max_gap)) {
+            std::cout << range << std::endl;
+            total += range.size;
+        }
+        std::cout << "bytes=" << total << std::endl;
+        return 0;
+    }
+
+    if (option == "--samples" || option == "--seek") {
+        if (reader.fragments > 0) {
+            std::cout << "fragments=" << reader.fragments << std::endl;
+        }
+        for (const auto &index : reader.segment_indexes) {
+            std::cout << index << std::endl;
+        }
+        for (const auto &track : reader.tracks) {
+            std::cout << track << std::endl;
+            if (option != "--seek" || track.timescale == 0) {
+                continue;
+            }
+            uint64_t t = static_cast<uint64_t>(seconds * track.timescale);
+            size_t sample = track.sample_at_time(t);
+            size_t keyframe = track.nearest_keyframe_before(t);
+            if (sample == SIZE_MAX || keyframe == SIZE_MAX) {
+                std::cout << "  no sample at " << seconds << "s" << std::endl;
+                continue;
+            }
+            std::cout << "  sample " << sample << " at dts=" << track.dts[sample]
+                      << ", offset=" << track.offsets[sample]
+                      << ", size=" << track.sizes[sample] << std::endl
+                      << "  keyframe " << keyframe
+                      << " at dts=" << track.dts[keyframe]
+                      << ", offset=" << track.offsets[keyframe]
+                      << ", size=" << track.sizes[keyframe] << std::endl;
+        }
+        return 0;
+    }
+
+    BoxPrinter printer(std::cout);
+    walkBoxes(input, printer);
 
     return 0;
 }
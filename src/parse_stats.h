@@ -0,0 +1,273 @@
+// Optional parse instrumentation shared by gif_parser and mp4_parser.
+//
+// While enabled, the parsers add up per structure type (each box FourCC,
+// each GIF block kind) how often it occurred, how many bytes it spanned
+// and how long it took, and the byte sources count the read system calls
+// and seeks underneath. Times are raw TSC readings, a couple of dozen
+// cycles each, so the counters can stay on for live traffic; they are
+// turned into seconds once, when the stats are dumped, against the
+// steady clock over the same interval.
+//
+// Every thread records into its own ParseStats, so batch workers do not
+// contend. Compiled with -DPARSER_NO_STATS, statsEnabled() is constant
+// false and every call site folds away.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <sys/resource.h>
+#include <vector>
+
+#include "json.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// A cheap monotonic timestamp in unspecified units.
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct ParseStats {
+    struct Structure {
+        uint32_t key = 0;
+        std::string name;
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        uint64_t ticks = 0; // inclusive: a container counts its children
+    };
+
+    bool enabled = false;
+    uint64_t readCalls = 0;  // read, pread and preadv
+    uint64_t ringEnters = 0; // io_uring_enter
+    uint64_t bytesRead = 0;
+    uint64_t seeks = 0; // jumps outside the bytes already in memory
+
+    // clears everything and starts counting on this thread
+    void enable() {
+        *this = ParseStats();
+        enabled = true;
+        startTicks = readTicks();
+        startTime = std::chrono::steady_clock::now();
+        rusage usage = {};
+        getrusage(RUSAGE_THREAD, &usage);
+        startMinorFaults = usage.ru_minflt;
+        startMajorFaults = usage.ru_majflt;
+    }
+
+    // `name` is only copied the first time `key` is seen
+    void addStructure(uint32_t key, std::string_view name, uint64_t bytes,
+                      uint64_t ticks) {
+        Structure &s = find(key, name);
+        ++s.count;
+        s.bytes += bytes;
+        s.ticks += ticks;
+    }
+
+    // the slowest first
+    std::vector<Structure> structures() const {
+        std::vector<Structure> sorted = table;
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const Structure &a, const Structure &b) {
+                      return a.ticks > b.ticks;
+                  });
+        return sorted;
+    }
+
+    // measured over the time since enable(), assuming an invariant TSC
+    double ticksPerSecond() const {
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - startTime)
+                             .count();
+        return seconds > 0 ? (readTicks() - startTicks) / seconds : 1e9;
+    }
+
+    std::string json(const std::string &tool) const {
+        rusage usage = {};
+        getrusage(RUSAGE_THREAD, &usage);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - startTime)
+                             .count();
+        double rate = ticksPerSecond();
+        char number[64];
+        std::string out = "{\"tool\":";
+        appendJson(out, tool);
+        out += ",\"version\":";
+        appendJson(out, PARSER_VERSION);
+#ifdef PARSER_NO_STATS
+        out += ",\"instrumented\":false";
+#else
+        out += ",\"instrumented\":true";
+#endif
+        std::snprintf(number, sizeof(number),
+                      ",\"seconds\":%.6g,\"ticks_per_second\":%.6g", seconds,
+                      rate);
+        out += number;
+        out += ",\"io\":{";
+        std::pair<const char *, uint64_t> io[] = {
+            {"read_calls", readCalls},
+            {"ring_enters", ringEnters},
+            {"bytes_read", bytesRead},
+            {"seeks", seeks},
+            {"minor_faults", usage.ru_minflt - startMinorFaults},
+            {"major_faults", usage.ru_majflt - startMajorFaults},
+        };
+        for (const auto &[key, value] : io) {
+            std::snprintf(number, sizeof(number), "\"%s\":%llu,", key,
+                          static_cast<unsigned long long>(value));
+            out += number;
+        }
+        out.back() = '}';
+        out += ",\"structures\":[";
+        for (const auto &s : structures()) {
+            out += "\n{\"type\":";
+            appendJson(out, s.name);
+            std::snprintf(number, sizeof(number),
+                          ",\"count\":%llu,\"bytes\":%llu,\"seconds\":%.6g},",
+                          static_cast<unsigned long long>(s.count),
+                          static_cast<unsigned long long>(s.bytes),
+                          s.ticks / rate);
+            out += number;
+        }
+        if (out.back() == ',') {
+            out.pop_back();
+        }
+        out += "]}\n";
+        return out;
+    }
+
+  private:
+    // open addressing over `table`; types past the last slot share one entry
+    static constexpr size_t slotCount = 256;
+    std::vector<Structure> table;
+    std::vector<uint16_t> slots; // index into table + 1, 0 when free
+    uint64_t startTicks = 0;
+    std::chrono::steady_clock::time_point startTime;
+    long startMinorFaults = 0;
+    long startMajorFaults = 0;
+
+    Structure &find(uint32_t key, std::string_view name) {
+        if (slots.empty()) {
+            slots.assign(slotCount, 0);
+            table.reserve(slotCount / 2);
+        }
+        size_t slot = (key * 2654435761u) >> 24;
+        for (size_t probe = 0; probe < slotCount; ++probe) {
+            uint16_t &entry = slots[(slot + probe) % slotCount];
+            if (entry == 0) {
+                if (table.size() + 1 >= slotCount / 2) {
+                    break; // keep probes short: the rest go to "other"
+                }
+                table.push_back({key, std::string(name)});
+                entry = static_cast<uint16_t>(table.size());
+                return table.back();
+            }
+            if (table[entry - 1].key == key) {
+                return table[entry - 1];
+            }
+        }
+        auto other = std::find_if(table.begin(), table.end(),
+                                  [](const Structure &s) {
+                                      return s.name == "(other)";
+                                  });
+        if (other != table.end()) {
+            return *other;
+        }
+        table.push_back({0, "(other)"});
+        return table.back();
+    }
+};
+
+inline ParseStats &parseStats() {
+    static thread_local ParseStats stats;
+    return stats;
+}
+
+#ifdef PARSER_NO_STATS
+constexpr bool statsEnabled() { return false; }
+#else
+inline bool statsEnabled() { return parseStats().enabled; }
+#endif
+
+// a read system call that returned `bytes`
+inline void countRead(size_t bytes) {
+    if (statsEnabled()) {
+        ++parseStats().readCalls;
+        parseStats().bytesRead += bytes;
+    }
+}
+
+// Times one structure from construction to destruction and adds it to this
+// thread's stats under `key`. The caller names it once it knows what it
+// is; a scope that was never named records nothing. Constructed over a
+// cursor position, the bytes it spanned are taken from there at the end.
+struct StructureScope {
+    uint32_t key = 0;
+    std::string_view name;
+    uint64_t bytes = 0;
+
+    StructureScope()
+        : stats(statsEnabled() ? &parseStats() : nullptr),
+          start(stats ? readTicks() : 0) {}
+    explicit StructureScope(const size_t &position) : StructureScope() {
+        cursor = &position;
+        begin = position;
+    }
+    StructureScope(const StructureScope &) = delete;
+    StructureScope &operator=(const StructureScope &) = delete;
+
+    ~StructureScope() {
+        if (stats && !name.empty()) {
+            if (cursor) {
+                bytes = *cursor - begin;
+            }
+            stats->addStructure(key, name, bytes, readTicks() - start);
+        }
+    }
+
+    // false when stats are off, so callers can skip naming the structure
+    bool active() const { return stats; }
+
+  private:
+    ParseStats *stats;
+    uint64_t start;
+    const size_t *cursor = nullptr;
+    size_t begin = 0;
+};
+
+// --stats: enables the calling thread's stats and writes them as JSON to
+// stderr when it goes out of scope, after whatever the tool did.
+struct StatsDump {
+    std::string tool;
+    bool active = false;
+
+    explicit StatsDump(std::string tool) : tool(std::move(tool)) {}
+    StatsDump(const StatsDump &) = delete;
+    StatsDump &operator=(const StatsDump &) = delete;
+
+    void enable() {
+        active = true;
+        parseStats().enable();
+    }
+
+    ~StatsDump() {
+        if (active) {
+            std::string json = parseStats().json(tool);
+            std::fwrite(json.data(), 1, json.size(), stderr);
+        }
+    }
+};
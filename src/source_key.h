@@ -0,0 +1,55 @@
+// Identity of a source file for the on-disk index caches of gif_parser and
+// mp4_parser: a cache written for one version of a file must not be used
+// for another.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+// Identifies the contents of a file without reading all of it: size, mtime
+// in nanoseconds and an FNV-1a hash of the first and last 4 KiB.
+struct SourceKey {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t headerHash = 0;
+
+    bool read(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        uint8_t head[4096];
+        uint8_t tail[4096];
+        size_t headSize = std::min<uint64_t>(size, sizeof(head));
+        size_t tailSize = std::min<uint64_t>(size, sizeof(tail));
+        bool ok = pread(fd, head, headSize, 0) == ssize_t(headSize) &&
+                  pread(fd, tail, tailSize, size - tailSize) ==
+                      ssize_t(tailSize);
+        close(fd);
+        if (!ok) {
+            return false;
+        }
+        headerHash = 14695981039346656037ull;
+        for (const auto &[p, n] : {std::pair(head, headSize),
+                                   std::pair(tail, tailSize)}) {
+            for (size_t i = 0; i < n; ++i) {
+                headerHash = (headerHash ^ p[i]) * 1099511628211ull;
+            }
+        }
+        return true;
+    }
+
+    bool operator==(const SourceKey &) const = default;
+};